@@ -9,30 +9,150 @@
  * @brief mmapしたファイルから値を読みだす
  */
 
+#define _GNU_SOURCE  // mremap, fallocate
+
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <fnmatch.h>
+#include <pthread.h>
 #include <unistd.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <strings.h>
 #include <string.h>
 #include <float.h>
+#include <limits.h>
+#include <math.h>
 
+#define REDISMODULE_EXPERIMENTAL_API  // BlockClient, thread safe contexts
 #include "redismodule.h"
 #include "sds.h"
 #include "zmalloc.h"
 
-typedef struct _MMapObject
+// aggregation kernels are cloned for AVX2 and picked at load time on x86_64 linux,
+// float and double have hand written AVX2 kernels dispatched at run time
+#if defined(__x86_64__) && defined(__linux__) && defined(__GNUC__)
+#include <immintrin.h>
+#define MAGG_X86
+#define MAGG_CLONES __attribute__((target_clones("avx2", "default")))
+#else
+#define MAGG_CLONES
+#endif
+
+typedef enum _MValueType
 {
-  sds file_path;
+  MTYPE_INT8,
+  MTYPE_UINT8,
+  MTYPE_INT16,
+  MTYPE_UINT16,
+  MTYPE_INT32,
+  MTYPE_UINT32,
+  MTYPE_INT64,
+  MTYPE_UINT64,
+  MTYPE_FLOAT,
+  MTYPE_DOUBLE,
+  MTYPE_LONG_DOUBLE,
+  MTYPE_STRING,
+  MTYPE_NUM
+} MValueType;
+
+__extension__ typedef __int128 mint128;
+
+// result of an aggregation kernel over n > 0 elements
+typedef struct _MAggregate
+{
+  mint128 isum;     // sum of integer types, it can't overflow
+  long double sum;  // sum of floating point types
+  long double min;
+  long double max;
+} MAggregate;
+
+// Operations on one element of a value_type.
+// ptr always points to the first byte of the element in the mapping.
+typedef struct _MTypeOps
+{
+  const char *name;
+  uint8_t value_size;  // 0 means value_size must be given by MMAP (string)
+  // reply the element
+  int (*reply)(RedisModuleCtx *ctx, const void *ptr, uint8_t value_size);
+  // parse value, check its bounds and store it to ptr
+  // return NULL on success, otherwise an error message
+  const char *(*parse)(const RedisModuleString *value, void *ptr, uint8_t value_size);
+  // sum, min and max of n > 0 elements from ptr, NULL if the type can't be aggregated
+  void (*aggregate)(const void *ptr, size_t n, MAggregate *agg);
+  // sum of squared deviations from mean of n elements from ptr
+  long double (*deviation)(const void *ptr, size_t n, double mean);
+} MTypeOps;
+
+// A mapping handed to readers off the main thread.
+// A remap publishes a new mapping, and the old one is unmapped when its last reader is done.
+typedef struct _MMapping
+{
+  void *addr;
+  size_t capacity;
+  int refs;             // readers and the key, while it is the current mapping (main thread only)
+} MMapping;
+
+// An open file, shared by every key that maps it. Keys on the same (st_dev, st_ino)
+// see the same mapping, so growth through one of them is visible to all.
+typedef struct _MFile
+{
+  sds path;             // the path of the first key that opened it
+  dev_t dev;
+  ino_t ino;
   int fd;
+  bool writable;        // opened read-write, by at least one key
   void *mmap;
-  size_t file_size;
-  sds value_type;
+  size_t file_size;     // logical size in bytes
+  size_t capacity;      // physical size of the file and the mapping
+  uint64_t *size_ptr;   // file_size persisted in the sidecar file (writable only)
+  struct _MHeader *header;  // mapped header, NULL if the file has none
+  size_t offset;        // bytes of the header, the values start there
+  uint64_t commit_seq;  // sequence of the last commit to the header
+  size_t committed_size;  // file_size in the last commit
+  // commit_seq and committed_size are written by the flusher while a flush of the file is queued
+  bool commit_pending;  // file_size isn't committed yet, see MQueueFlush
+  MMapping *snapshot;   // the current mapping, while readers hold it
+  int pins;             // readers of the current and the retired mappings (main thread only)
+  int refs;             // keys sharing the file
+  bool shrink_pending;  // a shrink to shrink_to waits for the readers or the fork child, see MApplyShrink
+  size_t shrink_to;
+  int follows;          // keys following the growth of the file
+  uint64_t load_seq;    // the load whose keys map the file, see MRdbLoadFile
+  size_t dirty_start;   // the range written since the last flush
+  size_t dirty_end;
+  uint64_t *epochs;     // the epoch of the last write to each MDIRTY_BLOCK bytes, 0 if never written
+  size_t blocks;        // length of epochs
+  uint64_t epoch;       // the epoch of the writes from now on, see MTakeEpoch
+  uint64_t synced_epoch;  // the blocks written after it aren't flushed yet
+  size_t dropped_end;   // the largest end of the values dropped by MTruncate
+  size_t synced_size;   // file_size at the last flush
+  long long dirty_since;  // time of the first write since the last flush, 0 if clean
+  struct _MFlush *queued; // the flush waiting for the flusher, guarded by MFlushLock
+  struct _MFile *next;
+} MFile;
+
+typedef struct _MMapObject
+{
+  sds file_path;
+  MFile *file;
+  MValueType value_type;
+  const MTypeOps *ops;
   uint8_t value_size;
   bool writable;
+  bool follow;          // the mapping grows with the file, see MFollowTick
+  bool header;          // write a header to the file if it is empty
+  bool embed;           // save the values of the file in RDB, see MRdbSave
+  uint64_t dirty_epoch; // VDIRTY reports the blocks written after it
+  int pins;             // readers of this key (main thread only)
+  bool freed;           // deleted while read, freed by the last reader
+  struct _MMapObject *next_free;  // freed off the main thread, see MFree
 } MMapObject;
 
 static inline int mstringcmp(const RedisModuleString *rs1, const char *s2)
@@ -40,198 +160,2927 @@ static inline int mstringcmp(const RedisModuleString *rs1, const char *s2)
   return strcasecmp(RedisModule_StringPtrLen(rs1, NULL), s2);
 }
 
-RedisModuleType *MMapType = NULL;
+// integers are summed in blocks into acctype, which can't overflow within a block,
+// and the block sums are carried into a 128 bit integer
+#define MAGG_INT_BLOCK (1 << 20)
+// floats are summed in independent lanes of double (or wider) with compensated
+// (Neumaier) summation, so that small values added to a large sum aren't lost,
+// and the lanes and their compensations are combined in long double
 
-MMapObject *MCreateObject(void)
+// add value to sum, collecting the rounding error of the addition in comp
+#define MAGG_ADD(acctype, sum, comp, value)                                       \
+  do {                                                                            \
+    acctype v_ = (value), t_ = (sum) + v_;                                        \
+    (comp) += ((sum) < 0 ? -(sum) : (sum)) >= (v_ < 0 ? -v_ : v_)                 \
+                  ? ((sum) - t_) + v_                                             \
+                  : (v_ - t_) + (sum);                                            \
+    (sum) = t_;                                                                   \
+  } while (0)
+
+// the sum of n lanes and their compensations
+// a compensation is NaN once its lane overflows, so they are dropped then
+static inline long double MAggLanes(const long double *sum, const long double *comp, int n)
 {
-  return (MMapObject *)zcalloc(sizeof(MMapObject));
+  long double total = 0, total_comp = 0;
+  for (int i = 0; i < n; ++i) {
+    MAGG_ADD(long double, total, total_comp, sum[i]);
+    total_comp += comp[i];
+  }
+  return isfinite(total) ? total + total_comp : total;
 }
 
-void MFree(void *value)
+#define MAGG_LANES(sum, comp)                                                     \
+  MAggLanes((const long double[]){(sum)[0], (sum)[1], (sum)[2], (sum)[3]},        \
+            (const long double[]){(comp)[0], (comp)[1], (comp)[2], (comp)[3]}, 4)
+
+// squared deviations are accumulated in 4 independent lanes so that they vectorize
+#define MDEFINE_DEVIATION(name, ctype, acctype)                                   \
+  static MAGG_CLONES long double MDeviation_##name(const void *ptr, size_t n,     \
+                                                   double mean)                   \
+  {                                                                               \
+    const ctype *values = ptr;                                                    \
+    acctype acc[4] = {0, 0, 0, 0}, comp[4] = {0, 0, 0, 0};                        \
+    size_t i = 0;                                                                 \
+    for (; i + 4 <= n; i += 4) {                                                  \
+      for (int j = 0; j < 4; ++j) {                                               \
+        acctype d = (acctype)values[i + j] - mean;                                \
+        MAGG_ADD(acctype, acc[j], comp[j], d * d);                                \
+      }                                                                           \
+    }                                                                             \
+    for (; i < n; ++i) {                                                          \
+      acctype d = (acctype)values[i] - mean;                                      \
+      MAGG_ADD(acctype, acc[0], comp[0], d * d);                                  \
+    }                                                                             \
+    return MAGG_LANES(acc, comp);                                                 \
+  }
+
+#define MDEFINE_INT_TYPE(name, ctype, acctype, vmin, vmax)                        \
+  static int MReply_##name(RedisModuleCtx *ctx, const void *ptr, uint8_t value_size) \
+  {                                                                               \
+    return RedisModule_ReplyWithLongLong(ctx, *(const ctype *)ptr);               \
+  }                                                                               \
+  static const char *MParse_##name(const RedisModuleString *rs, void *ptr,        \
+                                   uint8_t value_size)                            \
+  {                                                                               \
+    long long value;                                                              \
+    if (RedisModule_StringToLongLong(rs, &value) == REDISMODULE_ERR) {            \
+      return "value must be integer";                                             \
+    }                                                                             \
+    if (value < (vmin) || (vmax) < value) return "value must be " #name;          \
+    *(ctype *)ptr = (ctype)value;                                                 \
+    return NULL;                                                                  \
+  }                                                                               \
+  static MAGG_CLONES void MAggregate_##name(const void *ptr, size_t n,            \
+                                            MAggregate *agg)                      \
+  {                                                                               \
+    const ctype *values = ptr;                                                    \
+    ctype lo = values[0], hi = values[0];                                         \
+    for (size_t base = 0; base < n; base += MAGG_INT_BLOCK) {                     \
+      size_t end = n - base < MAGG_INT_BLOCK ? n : base + MAGG_INT_BLOCK;         \
+      acctype sum = 0;                                                            \
+      for (size_t i = base; i < end; ++i) {                                       \
+        sum += values[i];                                                         \
+        lo = values[i] < lo ? values[i] : lo;                                     \
+        hi = values[i] > hi ? values[i] : hi;                                     \
+      }                                                                           \
+      agg->isum += sum;                                                           \
+    }                                                                             \
+    agg->min = lo;                                                                \
+    agg->max = hi;                                                                \
+  }                                                                               \
+  MDEFINE_DEVIATION(name, ctype, double)
+
+MDEFINE_INT_TYPE(int8, int8_t, int64_t, INT8_MIN, INT8_MAX)
+MDEFINE_INT_TYPE(uint8, uint8_t, uint64_t, 0, UINT8_MAX)
+MDEFINE_INT_TYPE(int16, int16_t, int64_t, INT16_MIN, INT16_MAX)
+MDEFINE_INT_TYPE(uint16, uint16_t, uint64_t, 0, UINT16_MAX)
+MDEFINE_INT_TYPE(int32, int32_t, int64_t, INT32_MIN, INT32_MAX)
+MDEFINE_INT_TYPE(uint32, uint32_t, uint64_t, 0, UINT32_MAX)
+MDEFINE_INT_TYPE(int64, int64_t, mint128, INT64_MIN, INT64_MAX)
+// uint64 values are given as long long, so they can't exceed INT64_MAX
+MDEFINE_INT_TYPE(uint64, uint64_t, mint128, 0, INT64_MAX)
+
+#define MDEFINE_FLOAT_AGGREGATE(name, ctype, acctype)                             \
+  static void MAggregateScalar_##name(const ctype *values, size_t n,              \
+                                      MAggregate *agg)                            \
+  {                                                                               \
+    ctype lo = values[0], hi = values[0];                                         \
+    acctype sum[4] = {0, 0, 0, 0}, comp[4] = {0, 0, 0, 0};                        \
+    size_t i = 0;                                                                 \
+    for (; i + 4 <= n; i += 4) {                                                  \
+      for (int j = 0; j < 4; ++j) {                                               \
+        MAGG_ADD(acctype, sum[j], comp[j], values[i + j]);                        \
+        lo = values[i + j] < lo ? values[i + j] : lo;                             \
+        hi = values[i + j] > hi ? values[i + j] : hi;                             \
+      }                                                                           \
+    }                                                                             \
+    for (; i < n; ++i) {                                                          \
+      MAGG_ADD(acctype, sum[0], comp[0], values[i]);                              \
+      lo = values[i] < lo ? values[i] : lo;                                       \
+      hi = values[i] > hi ? values[i] : hi;                                       \
+    }                                                                             \
+    agg->sum += MAGG_LANES(sum, comp);                                            \
+    agg->min = lo;                                                                \
+    agg->max = hi;                                                                \
+  }                                                                               \
+  MDEFINE_DEVIATION(name, ctype, acctype)
+
+MDEFINE_FLOAT_AGGREGATE(float, float, double)
+MDEFINE_FLOAT_AGGREGATE(double, double, double)
+MDEFINE_FLOAT_AGGREGATE(long_double, long double, long double)
+
+#ifdef MAGG_X86
+// MAGG_ADD on 4 lanes
+__attribute__((target("avx2")))
+static inline void MAggAddAvx2(__m256d *sum, __m256d *comp, __m256d v)
 {
-  if (value == NULL) return;
-  const MMapObject *obj_ptr = value;
-  if (obj_ptr->mmap != NULL) munmap(obj_ptr->mmap, obj_ptr->file_size);
-  if (obj_ptr->fd != -1) close(obj_ptr->fd);
-  sdsfree(obj_ptr->file_path);
-  sdsfree(obj_ptr->value_type);
-  zfree(value);
+  const __m256d sign = _mm256_set1_pd(-0.0);
+  __m256d t = _mm256_add_pd(*sum, v);
+  __m256d larger = _mm256_cmp_pd(_mm256_andnot_pd(sign, *sum), _mm256_andnot_pd(sign, v), _CMP_GE_OQ);
+  __m256d err = _mm256_blendv_pd(_mm256_add_pd(_mm256_sub_pd(v, t), *sum),
+                                 _mm256_add_pd(_mm256_sub_pd(*sum, t), v), larger);
+  *comp = _mm256_add_pd(*comp, err);
+  *sum = t;
 }
 
-// MMAP key file_path value_type [value_size] [writable]
-int MMap_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
+// the sum of the lanes of sum0 and sum1 and the values left after them
+__attribute__((target("avx2")))
+static long double MAggTailAvx2(__m256d sum0, __m256d comp0, __m256d sum1, __m256d comp1,
+                                const void *values, size_t i, size_t n, bool single)
 {
-  RedisModule_AutoMemory(ctx); /* Use automatic memory management. */
-  if (argc < 4 || 6 < argc) return RedisModule_WrongArity(ctx);
-  bool writable = false;
-  uint8_t value_size = 0;
-  long long tmp_size;
-  for (int i = 4; i < argc; ++i) {
-    if (mstringcmp(argv[i], "writable") == 0) writable = true;
-    else if (RedisModule_StringToLongLong(argv[i], &tmp_size) == REDISMODULE_OK) {
-      if (tmp_size <= 0) {
-        return RedisModule_ReplyWithError(
-            ctx, "value_size must be positive");
-      }
-      if (0x100 <= tmp_size) {
-        return RedisModule_ReplyWithError(
-            ctx, "value_size must be between 1 and 255");
-      }
-      value_size = (uint8_t)tmp_size;
-    }
-    else {
-      return RedisModule_ReplyWithError(
-          ctx, "Arguments must be \"writable\" or integer");
-    }
+  double sum[8], comp[8];
+  _mm256_storeu_pd(sum, sum0);
+  _mm256_storeu_pd(sum + 4, sum1);
+  _mm256_storeu_pd(comp, comp0);
+  _mm256_storeu_pd(comp + 4, comp1);
+  for (; i < n; ++i) {
+    double value = single ? ((const float *)values)[i] : ((const double *)values)[i];
+    MAGG_ADD(double, sum[0], comp[0], value);
   }
+  long double lanes[8], comps[8];
+  for (int j = 0; j < 8; ++j) {
+    lanes[j] = sum[j];
+    comps[j] = comp[j];
+  }
+  return MAggLanes(lanes, comps, 8);
+}
 
-  if (mstringcmp(argv[3], "int8") == 0) {
-    if (value_size == 0) value_size = 1;
+// the min/max operand order matches the scalar kernels, so NaN is skipped the same way
+__attribute__((target("avx2")))
+static void MAggregateAvx2_float(const float *values, size_t n, MAggregate *agg)
+{
+  __m256 lo = _mm256_set1_ps(values[0]), hi = lo;
+  __m256d sum0 = _mm256_setzero_pd(), sum1 = sum0, comp0 = sum0, comp1 = sum0;
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m256 v = _mm256_loadu_ps(values + i);
+    MAggAddAvx2(&sum0, &comp0, _mm256_cvtps_pd(_mm256_castps256_ps128(v)));
+    MAggAddAvx2(&sum1, &comp1, _mm256_cvtps_pd(_mm256_extractf128_ps(v, 1)));
+    lo = _mm256_min_ps(v, lo);
+    hi = _mm256_max_ps(v, hi);
   }
-  else if (mstringcmp(argv[3], "uint8") == 0) {
-    if (value_size == 0) value_size = 1;
-    if (value_size != 1) {
-      return RedisModule_ReplyWithError(ctx, "invalid value_size");
-    }
+  agg->sum += MAggTailAvx2(sum0, comp0, sum1, comp1, values, i, n, true);
+  float los[8], his[8];
+  _mm256_storeu_ps(los, lo);
+  _mm256_storeu_ps(his, hi);
+  agg->min = los[0];
+  agg->max = his[0];
+  for (int j = 1; j < 8; ++j) {
+    if (los[j] < agg->min) agg->min = los[j];
+    if (his[j] > agg->max) agg->max = his[j];
   }
-  else if (mstringcmp(argv[3], "int16") == 0) {
-    if (value_size == 0) value_size = 2;
-    if (value_size != 2) {
-      return RedisModule_ReplyWithError(ctx, "invalid value_size");
-    }
+  for (; i < n; ++i) {
+    if (values[i] < agg->min) agg->min = values[i];
+    if (values[i] > agg->max) agg->max = values[i];
   }
-  else if (mstringcmp(argv[3], "uint16") == 0) {
-    if (value_size == 0) value_size = 2;
-    if (value_size != 2) {
-      return RedisModule_ReplyWithError(ctx, "invalid value_size");
-    }
+}
+
+__attribute__((target("avx2")))
+static void MAggregateAvx2_double(const double *values, size_t n, MAggregate *agg)
+{
+  __m256d lo = _mm256_set1_pd(values[0]), hi = lo;
+  __m256d sum0 = _mm256_setzero_pd(), sum1 = sum0, comp0 = sum0, comp1 = sum0;
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m256d v0 = _mm256_loadu_pd(values + i);
+    __m256d v1 = _mm256_loadu_pd(values + i + 4);
+    MAggAddAvx2(&sum0, &comp0, v0);
+    MAggAddAvx2(&sum1, &comp1, v1);
+    lo = _mm256_min_pd(v1, _mm256_min_pd(v0, lo));
+    hi = _mm256_max_pd(v1, _mm256_max_pd(v0, hi));
   }
-  else if (mstringcmp(argv[3], "int32") == 0) {
-    if (value_size == 0) value_size = 4;
-    if (value_size != 4) {
-      return RedisModule_ReplyWithError(ctx, "invalid value_size");
-    }
+  agg->sum += MAggTailAvx2(sum0, comp0, sum1, comp1, values, i, n, false);
+  double los[4], his[4];
+  _mm256_storeu_pd(los, lo);
+  _mm256_storeu_pd(his, hi);
+  agg->min = los[0];
+  agg->max = his[0];
+  for (int j = 1; j < 4; ++j) {
+    if (los[j] < agg->min) agg->min = los[j];
+    if (his[j] > agg->max) agg->max = his[j];
   }
-  else if (mstringcmp(argv[3], "uint32") == 0) {
-    if (value_size == 0) value_size = 4;
-    if (value_size != 4) {
-      return RedisModule_ReplyWithError(ctx, "invalid value_size");
-    }
+  for (; i < n; ++i) {
+    if (values[i] < agg->min) agg->min = values[i];
+    if (values[i] > agg->max) agg->max = values[i];
   }
-  else if (mstringcmp(argv[3], "int64") == 0) {
-    if (value_size == 0) value_size = 8;
-    if (value_size != 8) {
-      return RedisModule_ReplyWithError(ctx, "invalid value_size");
-    }
+}
+#endif
+
+static void MAggregate_float(const void *ptr, size_t n, MAggregate *agg)
+{
+#ifdef MAGG_X86
+  if (__builtin_cpu_supports("avx2")) {
+    MAggregateAvx2_float(ptr, n, agg);
+    return;
   }
-  else if (mstringcmp(argv[3], "uint64") == 0) {
-    if (value_size == 0) value_size = 8;
-    if (value_size != 8) {
-      return RedisModule_ReplyWithError(ctx, "invalid value_size");
-    }
+#endif
+  MAggregateScalar_float(ptr, n, agg);
+}
+
+static void MAggregate_double(const void *ptr, size_t n, MAggregate *agg)
+{
+#ifdef MAGG_X86
+  if (__builtin_cpu_supports("avx2")) {
+    MAggregateAvx2_double(ptr, n, agg);
+    return;
   }
-  else if (mstringcmp(argv[3], "float") == 0) {
-    if (value_size == 0) value_size = 4;
-    if (value_size != 4) {
-      return RedisModule_ReplyWithError(ctx, "invalid value_size");
-    }
+#endif
+  MAggregateScalar_double(ptr, n, agg);
+}
+
+static void MAggregate_long_double(const void *ptr, size_t n, MAggregate *agg)
+{
+  MAggregateScalar_long_double(ptr, n, agg);
+}
+
+static int MReply_float(RedisModuleCtx *ctx, const void *ptr, uint8_t value_size)
+{
+  return RedisModule_ReplyWithDouble(ctx, *(const float *)ptr);
+}
+
+static const char *MParse_float(const RedisModuleString *rs, void *ptr, uint8_t value_size)
+{
+  double value;
+  if (RedisModule_StringToDouble(rs, &value) == REDISMODULE_ERR) {
+    return "value must be float";
   }
-  else if (mstringcmp(argv[3], "double") == 0) {
-    if (value_size == 0) value_size = 8;
-    if (value_size != 8) {
-      return RedisModule_ReplyWithError(ctx, "invalid value_size");
-    }
+  if (value < -FLT_MAX || FLT_MAX < value) return "value must be float";
+  *(float *)ptr = (float)value;
+  return NULL;
+}
+
+static int MReply_double(RedisModuleCtx *ctx, const void *ptr, uint8_t value_size)
+{
+  return RedisModule_ReplyWithDouble(ctx, *(const double *)ptr);
+}
+
+static const char *MParse_double(const RedisModuleString *rs, void *ptr, uint8_t value_size)
+{
+  long double value;
+  if (RedisModule_StringToLongDouble(rs, &value) == REDISMODULE_ERR) {
+    return "value must be double";
   }
-  else if (mstringcmp(argv[3], "long_double") == 0) {
-    if (value_size == 0) value_size = 16;
-    if (value_size != 16) {
-      return RedisModule_ReplyWithError(ctx, "invalid value_size");
-    }
+  if (value < -DBL_MAX || DBL_MAX < value) return "value must be double";
+  *(double *)ptr = (double)value;
+  return NULL;
+}
+
+static int MReply_long_double(RedisModuleCtx *ctx, const void *ptr, uint8_t value_size)
+{
+  return RedisModule_ReplyWithLongDouble(ctx, *(const long double *)ptr);
+}
+
+static const char *MParse_long_double(const RedisModuleString *rs, void *ptr, uint8_t value_size)
+{
+  long double value;
+  if (RedisModule_StringToLongDouble(rs, &value) == REDISMODULE_ERR) {
+    return "value must be long double";
   }
-  else if (mstringcmp(argv[3], "string") == 0) {
-    if (value_size == 0) {
-      return RedisModule_ReplyWithError(
-        ctx, "string type must has value_size");
-    }
+  *(long double *)ptr = value;
+  return NULL;
+}
+
+// values are zero padded but a full length value has no terminator,
+// so the length is bounded by value_size and the reply is taken straight from the mapping
+static int MReply_string(RedisModuleCtx *ctx, const void *ptr, uint8_t value_size)
+{
+  return RedisModule_ReplyWithStringBuffer(ctx, ptr, strnlen(ptr, value_size));
+}
+
+static const char *MParse_string(const RedisModuleString *rs, void *ptr, uint8_t value_size)
+{
+  size_t len;
+  const char *value = RedisModule_StringPtrLen(rs, &len);
+  if (value_size < len) return "value is too long";
+  memcpy(ptr, value, len);
+  memset((char *)ptr + len, 0, value_size - len);
+  return NULL;
+}
+
+#define MTYPE_ENTRY(name, size) \
+  { #name, size, MReply_##name, MParse_##name, MAggregate_##name, MDeviation_##name }
+
+static const MTypeOps MTypeTable[MTYPE_NUM] = {
+  [MTYPE_INT8] = MTYPE_ENTRY(int8, 1),
+  [MTYPE_UINT8] = MTYPE_ENTRY(uint8, 1),
+  [MTYPE_INT16] = MTYPE_ENTRY(int16, 2),
+  [MTYPE_UINT16] = MTYPE_ENTRY(uint16, 2),
+  [MTYPE_INT32] = MTYPE_ENTRY(int32, 4),
+  [MTYPE_UINT32] = MTYPE_ENTRY(uint32, 4),
+  [MTYPE_INT64] = MTYPE_ENTRY(int64, 8),
+  [MTYPE_UINT64] = MTYPE_ENTRY(uint64, 8),
+  [MTYPE_FLOAT] = MTYPE_ENTRY(float, 4),
+  [MTYPE_DOUBLE] = MTYPE_ENTRY(double, 8),
+  [MTYPE_LONG_DOUBLE] = MTYPE_ENTRY(long_double, 16),
+  [MTYPE_STRING] = { "string", 0, MReply_string, MParse_string, NULL, NULL },
+};
+
+// return the value_type named name, or -1 if it is unknown
+static int MLookupType(const char *name)
+{
+  for (int i = 0; i < MTYPE_NUM; ++i) {
+    if (strcasecmp(name, MTypeTable[i].name) == 0) return i;
+  }
+  return -1;
+}
+
+static inline size_t MCount(const MMapObject *obj_ptr)
+{
+  return obj_ptr->file->file_size / obj_ptr->value_size;
+}
+
+static inline void *MElement(const MMapObject *obj_ptr, size_t index)
+{
+  return (char *)obj_ptr->file->mmap + index * obj_ptr->value_size;
+}
+
+// load a packed index from a binary argument which may not be aligned
+static inline uint64_t MLoadIndex64(const char *ptr)
+{
+  uint64_t index;
+  memcpy(&index, ptr, sizeof(index));
+  return index;
+}
+
+static inline uint64_t MLoadIndex32(const char *ptr)
+{
+  uint32_t index;
+  memcpy(&index, ptr, sizeof(index));
+  return index;
+}
+
+// The logical size of a writable file is kept in "<file_path>.len" while
+// the file has spare capacity at its end.
+#define MSIDECAR_SUFFIX ".len"
+#define MMIN_CAPACITY 0x1000
+
+// A file may instead start with a header, which describes its values and commits their count.
+// The values follow at header_size, which must be a multiple of the page size to be mapped.
+// New headers take MHEADER_SIZE, so that the file maps with any page size up to it.
+// Each commit goes to the older of two slots after the values are stored,
+// so a torn commit leaves the previous count.
+#define MHEADER_MAGIC "FMMAPHDR"
+#define MHEADER_VERSION 1
+#define MHEADER_SIZE 0x10000
+
+typedef struct _MCommit
+{
+  uint64_t seq;
+  uint64_t count;       // number of values
+  uint64_t capacity;    // bytes reserved for the values
+  uint64_t checksum;    // of the fields above
+} MCommit;
+
+typedef struct _MHeader
+{
+  char magic[8];
+  uint32_t version;
+  uint32_t header_size;
+  char value_type[16];
+  uint32_t value_size;
+  uint32_t reserved;
+  uint64_t checksum;    // of the fields above
+  MCommit commits[2];
+} MHeader;
+
+// FNV-1a
+static uint64_t MChecksum(const void *ptr, size_t len)
+{
+  const unsigned char *bytes = ptr;
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  for (size_t i = 0; i < len; ++i) {
+    hash ^= bytes[i];
+    hash *= 0x100000001b3ULL;
+  }
+  return hash;
+}
+
+// the valid commit with the highest seq whose values fit in capacity bytes
+// it is copied, since another process may be writing it
+static bool MLatestCommit(const MHeader *header, size_t capacity, MCommit *latest)
+{
+  bool found = false;
+  for (int i = 0; i < 2; ++i) {
+    MCommit commit;
+    memcpy(&commit, &header->commits[i], sizeof(commit));
+    if (commit.checksum != MChecksum(&commit, offsetof(MCommit, checksum))) continue;
+    if (capacity / header->value_size < commit.count) continue;
+    if (found && commit.seq < latest->seq) continue;
+    *latest = commit;
+    found = true;
+  }
+  return found;
+}
+
+// commit file_size bytes of values to the header, which must be on the disk already
+static void MCommitHeader(MFile *file, size_t file_size, size_t capacity)
+{
+  MCommit commit = {file->commit_seq + 1, file_size / file->header->value_size, capacity, 0};
+  commit.checksum = MChecksum(&commit, offsetof(MCommit, checksum));
+  memcpy(&file->header->commits[commit.seq & 1], &commit, sizeof(commit));
+  file->commit_seq = commit.seq;
+  file->committed_size = file_size;
+}
+
+// the new size is committed to the header by the flush of its values, see MQueueFlush and MSyncFileNow
+static inline void MSetFileSize(MMapObject *obj_ptr, size_t file_size)
+{
+  obj_ptr->file->file_size = file_size;
+  if (obj_ptr->file->size_ptr != NULL) *obj_ptr->file->size_ptr = file_size;
+  else if (obj_ptr->file->header != NULL) obj_ptr->file->commit_pending = true;
+}
+
+// map capacity bytes of file, replacing its current mapping
+static int MRemapFile(MFile *file, size_t capacity)
+{
+  int prot = file->writable ? PROT_READ | PROT_WRITE : PROT_READ;
+  void *addr;
+  if (capacity == 0) {
+    if (file->mmap != NULL && file->snapshot == NULL) munmap(file->mmap, file->capacity);
+    addr = NULL;
+  }
+  else if (file->mmap == NULL || file->snapshot != NULL) {
+    // the current mapping is left to its readers
+    addr = mmap(NULL, capacity, prot, MAP_SHARED, file->fd, file->offset);
   }
   else {
-    return RedisModule_ReplyWithError(
-      ctx, "value_type must be int8, uint8, int16, uint16, int32, uint32, int64, uint64, float, double, long_double or string");
+#ifdef __linux__
+    addr = mremap(file->mmap, file->capacity, capacity, MREMAP_MAYMOVE);
+#else
+    munmap(file->mmap, file->capacity);
+    addr = mmap(NULL, capacity, prot, MAP_SHARED, file->fd, file->offset);
+#endif
+  }
+  if (addr == MAP_FAILED) {
+#ifndef __linux__
+    if (file->snapshot == NULL) {
+      file->mmap = NULL;
+      file->capacity = 0;
+    }
+#endif
+    return -1;
   }
+  if (file->snapshot != NULL) {
+    // retire the mapping, its last reader unmaps it
+    --file->snapshot->refs;
+    file->snapshot = NULL;
+  }
+  file->mmap = addr;
+  file->capacity = capacity;
+  return 0;
+}
 
-  RedisModuleKey *key = RedisModule_OpenKey(ctx, argv[1], REDISMODULE_READ | REDISMODULE_WRITE);
-  int type = RedisModule_KeyType(key);
-  if (type != REDISMODULE_KEYTYPE_EMPTY &&
-      RedisModule_ModuleTypeGetType(key) != MMapType) {
-    return RedisModule_ReplyWithError(ctx, REDISMODULE_ERRORMSG_WRONGTYPE);
+// a fork child (BGSAVE or AOF rewrite) reads the files through their mappings,
+// so they can't shrink or be truncated until it exits
+static bool MChildActive(void)
+{
+  return RedisModule_GetContextFlags(NULL) & REDISMODULE_CTX_FLAGS_ACTIVE_CHILD;
+}
+
+// change the physical size of the file and its mapping to capacity bytes
+static int MResizeFile(MFile *file, size_t capacity)
+{
+  size_t old_capacity = file->capacity;
+  if (capacity == old_capacity) return 0;
+  // readers may still read up to the capacity of their mapping, and a fork child reads
+  // the file, so the shrink waits for the last of them, see MUnpinFile and MForkChildEvent
+  if (capacity < old_capacity && (file->pins > 0 || MChildActive())) {
+    file->shrink_pending = true;
+    file->shrink_to = capacity;
+    return 0;
+  }
+  if (old_capacity < capacity) {
+    file->shrink_pending = false;
+#ifdef __linux__
+    // allocate blocks so that stores into the mapping can't hit ENOSPC
+    if (fallocate(file->fd, 0, file->offset, capacity) == -1 &&
+        ftruncate(file->fd, file->offset + capacity) == -1) return -1;
+#else
+    if (ftruncate(file->fd, file->offset + capacity) == -1) return -1;
+#endif
+  }
+  if (MRemapFile(file, capacity) == -1) {
+    if (old_capacity < capacity) ftruncate(file->fd, file->offset + old_capacity);
+    return -1;
+  }
+  if (capacity < old_capacity) {
+    ftruncate(file->fd, file->offset + capacity);
+    // the last commit may count popped values past the new capacity. no flush is queued,
+    // since it pins the file, and the values below the committed size are on the disk
+    if (file->header != NULL) {
+      MCommitHeader(file, file->committed_size < file->file_size ? file->committed_size : file->file_size,
+                    capacity);
+    }
   }
+  return 0;
+}
 
-  /* Create an empty value object if the key is currently empty. */
-  MMapObject *obj_ptr;
-  if (type == REDISMODULE_KEYTYPE_EMPTY) {
-    obj_ptr = MCreateObject();
-    obj_ptr->file_path = sdsnew(RedisModule_StringPtrLen(argv[2], NULL));
-    obj_ptr->value_type = sdsnew(RedisModule_StringPtrLen(argv[3], NULL));
-    obj_ptr->value_size = value_size;
-    obj_ptr->writable = writable;
-    if (obj_ptr->writable) {
-      obj_ptr->fd = open(obj_ptr->file_path, O_RDWR | O_CREAT, 0666);
-      if (obj_ptr->fd == -1) {
-        int ret = RedisModule_ReplyWithError(ctx, obj_ptr->file_path);
-        MFree(obj_ptr);
-        return ret;
-      }
+static int MResize(MMapObject *obj_ptr, size_t capacity)
+{
+  return MResizeFile(obj_ptr->file, capacity);
+}
+
+// make room for at least size bytes. the capacity grows geometrically
+static int MReserve(MMapObject *obj_ptr, size_t size)
+{
+  if (size <= obj_ptr->file->capacity) return 0;
+  size_t capacity = obj_ptr->file->capacity * 2;
+  if (capacity < MMIN_CAPACITY) capacity = MMIN_CAPACITY;
+  if (capacity < size) capacity = size;
+  size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+  capacity = (capacity + page_size - 1) / page_size * page_size;
+  return MResize(obj_ptr, capacity);
+}
+
+// give back spare capacity once the logical size falls below a quarter of it
+// halving (not fitting) the capacity leaves room to grow without remapping again
+static void MShrinkLazily(MMapObject *obj_ptr)
+{
+  if (obj_ptr->file->capacity <= MMIN_CAPACITY || obj_ptr->file->capacity / 4 < obj_ptr->file->file_size) return;
+  size_t capacity = obj_ptr->file->capacity / 2;
+  size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+  capacity = (capacity + page_size - 1) / page_size * page_size;
+  if (capacity < MMIN_CAPACITY) capacity = MMIN_CAPACITY;
+  MResize(obj_ptr, capacity);
+}
+
+#define MGATHER_SORT_THRESHOLD 64
+#define MGATHER_PREFETCH_DISTANCE 8
+#define MGATHER_ADVISE_GAP 4  // pages between runs advised at once
+
+typedef struct {
+  uint64_t index;
+  size_t pos;
+} MGatherEntry;
+
+static int MGatherEntryCmp(const void *a, const void *b)
+{
+  uint64_t ia = ((const MGatherEntry *)a)->index;
+  uint64_t ib = ((const MGatherEntry *)b)->index;
+  return ia < ib ? -1 : ia > ib;
+}
+
+// copy the values at indices among count values from base into out in the order of indices
+// out of range indices are left as they are in out
+// large batches are visited in file order so that neighbouring indices share page faults,
+// and repeated indices are read only once
+// the touched pages are advised ahead if advise is set, which the main thread leaves to the page in
+static void MGather(const char *base, size_t count, uint8_t value_size,
+                    const uint64_t *indices, size_t n, char *out, bool advise)
+{
+  if (n < MGATHER_SORT_THRESHOLD) {
+    for (size_t i = 0; i < n; ++i) {
+      if (indices[i] < count) memcpy(out + i * value_size, base + indices[i] * value_size, value_size);
     }
-    else {
-      obj_ptr->fd = open(obj_ptr->file_path, O_RDONLY);
-      if (obj_ptr->fd == -1) {
-        int ret = RedisModule_ReplyWithError(ctx, obj_ptr->file_path);
-        MFree(obj_ptr);
-        return ret;
+    return;
+  }
+
+  MGatherEntry *entries = zmalloc(sizeof(MGatherEntry) * n);
+  size_t m = 0;
+  for (size_t i = 0; i < n; ++i) {
+    if (indices[i] >= count) continue;
+    entries[m].index = indices[i];
+    entries[m].pos = i;
+    ++m;
+  }
+  qsort(entries, m, sizeof(MGatherEntry), MGatherEntryCmp);
+
+  // advise runs of pages at once, joining the runs within a small gap
+  if (advise) {
+    size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+    size_t gap = MGATHER_ADVISE_GAP * page_size;
+    size_t run_start = 0, run_end = 0;
+    for (size_t i = 0; i < m; ++i) {
+      size_t offset = entries[i].index * value_size;
+      size_t first = offset / page_size * page_size;
+      size_t last = (offset + value_size + page_size - 1) / page_size * page_size;
+      if (run_end != 0 && first <= run_end + gap) {
+        if (run_end < last) run_end = last;
+        continue;
       }
+      if (run_end != 0) madvise((char *)base + run_start, run_end - run_start, MADV_WILLNEED);
+      run_start = first;
+      run_end = last;
     }
-    struct stat sb;
-    if (fstat(obj_ptr->fd, &sb) == -1) {
-      int ret = RedisModule_ReplyWithError(ctx, obj_ptr->file_path);
-      MFree(obj_ptr);
-      return ret;
+    if (run_end != 0) madvise((char *)base + run_start, run_end - run_start, MADV_WILLNEED);
+  }
+
+  for (size_t i = 0; i < m; ++i) {
+    if (i + MGATHER_PREFETCH_DISTANCE < m) {
+      __builtin_prefetch(base + entries[i + MGATHER_PREFETCH_DISTANCE].index * value_size, 0, 0);
+    }
+    const void *src = i > 0 && entries[i - 1].index == entries[i].index
+                          ? out + entries[i - 1].pos * value_size
+                          : base + entries[i].index * value_size;
+    memcpy(out + entries[i].pos * value_size, src, value_size);
+  }
+  zfree(entries);
+}
+
+// Module configuration
+// set by name value pairs on loadmodule, or VCONFIG SET at run time
+
+static long long MThreads = 4;
+static long long MJobThreshold = 1 << 23;
+static long long MPageInEnabled = 1;
+static long long MGatherThreshold = 1 << 18;
+static long long MGatherThreads = 0;
+static long long MFollowInterval = 1000;
+static long long MFsyncPolicy = 1;
+
+#define MFSYNC_NO 0
+#define MFSYNC_EVERYSEC 1
+#define MFSYNC_ALWAYS 2
+static const char *MFsyncNames[] = {"no", "everysec", "always", NULL};
+
+#define MEMBED_KEY 0  // embed the files of the keys mapped with embed in RDB
+#define MEMBED_ALL 1  // embed the files of all keys
+static long long MEmbedPolicy = MEMBED_KEY;
+static const char *MEmbedNames[] = {"key", "all", NULL};
+// where an embedded file is written on load. {path} is the path of the saved key,
+// {base} its last component and {key} the name of the key
+static char MEmbedPath[PATH_MAX] = "{path}";
+
+typedef struct _MConfig
+{
+  const char *name;
+  long long *value;
+  long long min;
+  long long max;
+  bool runtime;  // can be changed by VCONFIG SET
+  const char **names;  // names of the values from min, if the value is one of them
+  char *text;  // the value is a string of up to PATH_MAX bytes, if not NULL
+} MConfig;
+
+static MConfig MConfigs[] = {
+  {"threads", &MThreads, 0, 64, false, NULL, NULL},
+  {"job-threshold", &MJobThreshold, 0, LLONG_MAX, true, NULL, NULL},
+  {"pagein", &MPageInEnabled, 0, 1, true, NULL, NULL},
+  {"gather-threshold", &MGatherThreshold, 0, LLONG_MAX, true, NULL, NULL},
+  {"gather-threads", &MGatherThreads, 0, 64, true, NULL, NULL},
+  {"follow-interval", &MFollowInterval, 1, 3600000, true, NULL, NULL},
+  {"fsync", &MFsyncPolicy, MFSYNC_NO, MFSYNC_ALWAYS, true, MFsyncNames, NULL},
+  {"embed", &MEmbedPolicy, MEMBED_KEY, MEMBED_ALL, true, MEmbedNames, NULL},
+  {"embed-path", NULL, 0, 0, true, NULL, MEmbedPath},
+};
+
+#define MCONFIG_NUM (sizeof(MConfigs) / sizeof(MConfigs[0]))
+
+// return NULL on success, otherwise an error message
+static const char *MConfigSet(const RedisModuleString *name, const RedisModuleString *value,
+                              bool loading)
+{
+  for (size_t i = 0; i < MCONFIG_NUM; ++i) {
+    if (mstringcmp(name, MConfigs[i].name) != 0) continue;
+    if (!loading && !MConfigs[i].runtime) return "The parameter can be set only on load";
+    if (MConfigs[i].text != NULL) {
+      size_t len;
+      const char *text = RedisModule_StringPtrLen(value, &len);
+      if (len >= PATH_MAX) return "The value is too long";
+      memcpy(MConfigs[i].text, text, len + 1);
+      return NULL;
     }
-    obj_ptr->file_size = sb.st_size;
-    if (0 < obj_ptr->file_size) {
-      if (obj_ptr->writable) {
-        obj_ptr->mmap = mmap(NULL, sb.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, obj_ptr->fd, 0);
-      }
-      else {
-        obj_ptr->mmap = mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, obj_ptr->fd, 0);
+    long long v;
+    if (MConfigs[i].names != NULL) {
+      for (v = 0; MConfigs[i].names[v] != NULL; ++v) {
+        if (mstringcmp(value, MConfigs[i].names[v]) == 0) break;
       }
-      if (obj_ptr->mmap == MAP_FAILED) {
-        int ret = RedisModule_ReplyWithError(ctx, obj_ptr->file_path);
-        MFree(obj_ptr);
-        return ret;
-      }
-    }
-    else obj_ptr->mmap = NULL;
-    RedisModule_ModuleTypeSetValue(key, MMapType, obj_ptr);
-  }
-  else {
-    obj_ptr = RedisModule_ModuleTypeGetValue(key);
-    if (obj_ptr == NULL) {
-      RedisModule_ReplyWithNull(ctx);
-      return REDISMODULE_ERR;
+      if (MConfigs[i].names[v] == NULL) return "The value is unknown";
+      v += MConfigs[i].min;
     }
-    if (strcmp(obj_ptr->file_path, RedisModule_StringPtrLen(argv[2], NULL)) != 0) {
-      return RedisModule_ReplyWithError(ctx, "It is already mapped on another file");
+    else if (RedisModule_StringToLongLong(value, &v) == REDISMODULE_ERR ||
+             v < MConfigs[i].min || MConfigs[i].max < v) {
+      return "The value is out of range";
     }
+    *MConfigs[i].value = v;
+    return NULL;
+  }
+  return "Unknown parameter";
+}
+
+// Worker threads
+// They run the page ins and the morsels of the background jobs, page ins first.
+static pthread_mutex_t MJobLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t MJobCond = PTHREAD_COND_INITIALIZER;
+
+// the client can be blocked
+static bool MCanBlockClient(RedisModuleCtx *ctx)
+{
+  int flags = RedisModule_GetContextFlags(ctx);
+  return !(flags & (REDISMODULE_CTX_FLAGS_MULTI | REDISMODULE_CTX_FLAGS_LUA |
+                    REDISMODULE_CTX_FLAGS_DENY_BLOCKING));
+}
+
+// the client can be blocked until a worker thread is done
+static bool MCanBlock(RedisModuleCtx *ctx)
+{
+  return MThreads > 0 && MCanBlockClient(ctx);
+}
+
+// Paging in
+// A read of pages which are not resident takes major faults on the main thread.
+// Such a command blocks the client, a worker thread reads the pages into the page cache
+// through a dup of the file descriptor, and the command runs again in the reply callback.
+
+#define MPAGEIN_SPAN 512          // pages checked by one mincore
+#define MPAGEIN_BUFFER (1 << 20)  // bytes read by one pread
+
+typedef struct _MRun
+{
+  size_t offset;
+  size_t len;
+} MRun;
+
+typedef struct _MRunList
+{
+  MRun *runs;
+  size_t len;
+  size_t cap;
+} MRunList;
+
+typedef struct _MPageIn
+{
+  int fd;
+  size_t base;          // file offset of the values
+  MRunList runs;
+  RedisModuleBlockedClient *bc;
+  RedisModuleCmdFunc cmd;
+  RedisModuleString **argv;
+  int argc;
+  MMapObject *reload;  // the object opened by VRELOAD warm, kept for its replay
+  struct _MPageIn *next;
+} MPageIn;
+
+static MPageIn *MPageIns = NULL;    // guarded by MJobLock
+static bool MPageInReplay = false;  // the command runs again after its page in
+static MMapObject *MPageInReload = NULL;  // the reload of the replay, taken by VRELOAD
+static long long MPageInCount = 0;  // page ins started, reported by INFO (main thread only)
+static long long MPageInBytes = 0;  // bytes of the cold pages they read
+
+void MFree(void *value);
+
+// add len bytes from offset to list, joining them to the last run if they follow it
+static void MAddRun(MRunList *list, size_t offset, size_t len)
+{
+  if (list->len > 0 && list->runs[list->len - 1].offset + list->runs[list->len - 1].len == offset) {
+    list->runs[list->len - 1].len += len;
+    return;
+  }
+  if (list->len == list->cap) {
+    list->cap = list->cap == 0 ? 16 : list->cap * 2;
+    list->runs = zrealloc(list->runs, sizeof(MRun) * list->cap);
+  }
+  list->runs[list->len].offset = offset;
+  list->runs[list->len].len = len;
+  ++list->len;
+}
+
+// add the cold pages among npages pages from first to list
+// only the sorted pages are checked if pages isn't NULL
+static void MCheckSpan(const MMapObject *obj_ptr, size_t first, size_t npages,
+                       const size_t *pages, size_t n, MRunList *list)
+{
+  size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+  unsigned char vec[MPAGEIN_SPAN];
+  // treat the pages as resident if it can't be told
+  if (mincore((char *)obj_ptr->file->mmap + first * page_size, npages * page_size, vec) == -1) return;
+  if (pages == NULL) {
+    for (size_t i = 0; i < npages; ++i) {
+      if (!(vec[i] & 1)) MAddRun(list, (first + i) * page_size, page_size);
+    }
+    return;
+  }
+  for (size_t i = 0; i < n; ++i) {
+    if (!(vec[pages[i] - first] & 1)) MAddRun(list, pages[i] * page_size, page_size);
+  }
+}
+
+static void MColdRange(const MMapObject *obj_ptr, size_t offset, size_t len, MRunList *list)
+{
+  if (len == 0) return;
+  size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+  size_t first = offset / page_size;
+  size_t last = (offset + len - 1) / page_size;
+  for (size_t page = first; page <= last; page += MPAGEIN_SPAN) {
+    size_t npages = last - page + 1 < MPAGEIN_SPAN ? last - page + 1 : MPAGEIN_SPAN;
+    MCheckSpan(obj_ptr, page, npages, NULL, 0, list);
+  }
+}
+
+static int MPageCmp(const void *a, const void *b)
+{
+  size_t pa = *(const size_t *)a, pb = *(const size_t *)b;
+  return pa < pb ? -1 : pa > pb;
+}
+
+// indices out of range are ignored
+static void MColdIndices(const MMapObject *obj_ptr, const uint64_t *indices, size_t n, MRunList *list)
+{
+  size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+  size_t count = MCount(obj_ptr);
+  // a value may lie across two pages
+  size_t *pages = zmalloc(sizeof(size_t) * 2 * n + 1);
+  size_t m = 0;
+  for (size_t i = 0; i < n; ++i) {
+    if (count <= indices[i]) continue;
+    size_t offset = indices[i] * obj_ptr->value_size;
+    pages[m++] = offset / page_size;
+    if ((offset + obj_ptr->value_size - 1) / page_size != offset / page_size) {
+      pages[m++] = offset / page_size + 1;
+    }
+  }
+  qsort(pages, m, sizeof(size_t), MPageCmp);
+  size_t unique = 0;
+  for (size_t i = 0; i < m; ++i) {
+    if (unique == 0 || pages[unique - 1] != pages[i]) pages[unique++] = pages[i];
+  }
+  for (size_t i = 0; i < unique;) {
+    size_t j = i + 1;
+    while (j < unique && pages[j] - pages[i] < MPAGEIN_SPAN) ++j;
+    MCheckSpan(obj_ptr, pages[i], pages[j - 1] - pages[i] + 1, pages + i, j - i, list);
+    i = j;
+  }
+  zfree(pages);
+}
+
+static bool MPageInAllowed(RedisModuleCtx *ctx)
+{
+  return MPageInEnabled && !MPageInReplay && MCanBlock(ctx);
+}
+
+static void MPageInRun(MPageIn *page_in)
+{
+  char *buffer = zmalloc(MPAGEIN_BUFFER);
+  for (size_t i = 0; i < page_in->runs.len; ++i) {
+    size_t offset = page_in->runs.runs[i].offset;
+    size_t end = offset + page_in->runs.runs[i].len;
+    while (offset < end) {
+      size_t len = end - offset < MPAGEIN_BUFFER ? end - offset : MPAGEIN_BUFFER;
+      if (pread(page_in->fd, buffer, len, page_in->base + offset) <= 0) break;
+      offset += len;
+    }
+  }
+  zfree(buffer);
+}
+
+static int MPageInReply(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
+{
+  MPageIn *page_in = RedisModule_GetBlockedClientPrivateData(ctx);
+  MPageInReplay = true;
+  MPageInReload = page_in->reload;
+  page_in->reload = NULL;
+  int ret = page_in->cmd(ctx, page_in->argv, page_in->argc);
+  MPageInReplay = false;
+  // the command didn't take it if it failed
+  MFree(MPageInReload);
+  MPageInReload = NULL;
+  return ret;
+}
+
+static void MPageInFree(RedisModuleCtx *ctx, void *privdata)
+{
+  MPageIn *page_in = privdata;
+  MFree(page_in->reload);
+  close(page_in->fd);
+  for (int i = 0; i < page_in->argc; ++i) RedisModule_FreeString(NULL, page_in->argv[i]);
+  zfree(page_in->argv);
+  zfree(page_in->runs.runs);
+  zfree(page_in);
+}
+
+// if list has cold pages, block the client until a worker thread pages them in,
+// and then run cmd again. return true if the client is blocked
+// reload is owned by the page in if the client is blocked, and handed to cmd as MPageInReload
+static bool MPageInStart(RedisModuleCtx *ctx, const MMapObject *obj_ptr, MRunList *list,
+                         RedisModuleString **argv, int argc, RedisModuleCmdFunc cmd,
+                         MMapObject *reload)
+{
+  int fd = list->len > 0 ? dup(obj_ptr->file->fd) : -1;
+  if (fd == -1) {
+    zfree(list->runs);
+    return false;
+  }
+  MPageIn *page_in = zcalloc(sizeof(MPageIn));
+  page_in->fd = fd;
+  page_in->base = obj_ptr->file->offset;
+  page_in->runs = *list;
+  page_in->cmd = cmd;
+  page_in->reload = reload;
+  page_in->argc = argc;
+  page_in->argv = zmalloc(sizeof(RedisModuleString *) * argc);
+  for (int i = 0; i < argc; ++i) {
+    RedisModule_RetainString(NULL, argv[i]);
+    page_in->argv[i] = argv[i];
+  }
+  page_in->bc = RedisModule_BlockClient(ctx, MPageInReply, NULL, MPageInFree, 0);
+  ++MPageInCount;
+  for (size_t i = 0; i < list->len; ++i) MPageInBytes += list->runs[i].len;
+
+  pthread_mutex_lock(&MJobLock);
+  page_in->next = MPageIns;
+  MPageIns = page_in;
+  pthread_cond_signal(&MJobCond);
+  pthread_mutex_unlock(&MJobLock);
+  return true;
+}
+
+// page in len bytes from offset, see MPageInStart
+static bool MPageInRange(RedisModuleCtx *ctx, const MMapObject *obj_ptr, size_t offset, size_t len,
+                         RedisModuleString **argv, int argc, RedisModuleCmdFunc cmd)
+{
+  if (!MPageInAllowed(ctx)) return false;
+  MRunList list = {NULL, 0, 0};
+  MColdRange(obj_ptr, offset, len, &list);
+  return MPageInStart(ctx, obj_ptr, &list, argv, argc, cmd, NULL);
+}
+
+// page in the values at indices, see MPageInStart
+static bool MPageInIndices(RedisModuleCtx *ctx, const MMapObject *obj_ptr, const uint64_t *indices,
+                           size_t n, RedisModuleString **argv, int argc, RedisModuleCmdFunc cmd)
+{
+  if (!MPageInAllowed(ctx)) return false;
+  MRunList list = {NULL, 0, 0};
+  MColdIndices(obj_ptr, indices, n, &list);
+  return MPageInStart(ctx, obj_ptr, &list, argv, argc, cmd, NULL);
+}
+
+// files opened by any key, keyed by (st_dev, st_ino) (main thread only)
+static MFile *MFiles = NULL;
+
+// the sidecar which keeps the logical size of file_path
+static sds MSidecarPath(const char *file_path)
+{
+  return sdscat(sdsnew(file_path), MSIDECAR_SUFFIX);
+}
+
+// read the logical size from the sidecar of file->path, and map it if the file is writable
+static int MOpenSidecar(MFile *file)
+{
+  sds sidecar_path = MSidecarPath(file->path);
+  int sidecar_fd = open(sidecar_path, file->writable ? O_RDWR | O_CREAT : O_RDONLY, 0666);
+  sdsfree(sidecar_path);
+  if (sidecar_fd == -1) return file->writable ? -1 : 0;
+  uint64_t file_size;
+  if (pread(sidecar_fd, &file_size, sizeof(file_size), 0) == sizeof(file_size) &&
+      file_size <= file->capacity) {
+    file->file_size = file_size;
+  }
+  if (file->writable) {
+    if (ftruncate(sidecar_fd, sizeof(uint64_t)) == 0) {
+      file->size_ptr = mmap(NULL, sizeof(uint64_t), PROT_READ | PROT_WRITE,
+                            MAP_SHARED, sidecar_fd, 0);
+      if (file->size_ptr == MAP_FAILED) file->size_ptr = NULL;
+    }
+    if (file->size_ptr == NULL) {
+      close(sidecar_fd);
+      return -1;
+    }
+    *file->size_ptr = file->file_size;
+  }
+  close(sidecar_fd);
+  return 0;
+}
+
+// map the values of the file
+static void *MMapFile(MFile *file)
+{
+  if (file->capacity == 0) return NULL;
+  int prot = file->writable ? PROT_READ | PROT_WRITE : PROT_READ;
+  return mmap(NULL, file->capacity, prot, MAP_SHARED, file->fd, file->offset);
+}
+
+// read the header of the file of obj_ptr, or write one if the file is empty and obj_ptr asks for it
+// size is the size of the file. return NULL on success, otherwise an error message
+static const char *MOpenHeader(MFile *file, MMapObject *obj_ptr, size_t size)
+{
+  MHeader header;
+  size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+  if (size == 0 && obj_ptr->header && file->writable && obj_ptr->ops != NULL) {
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, MHEADER_MAGIC, sizeof(header.magic));
+    header.version = MHEADER_VERSION;
+    header.header_size = MHEADER_SIZE;
+    strncpy(header.value_type, obj_ptr->ops->name, sizeof(header.value_type) - 1);
+    header.value_size = obj_ptr->value_size;
+    header.checksum = MChecksum(&header, offsetof(MHeader, checksum));
+    header.commits[0].checksum = MChecksum(&header.commits[0], offsetof(MCommit, checksum));
+    if (ftruncate(file->fd, MHEADER_SIZE) == -1 ||
+        pwrite(file->fd, &header, sizeof(header), 0) != sizeof(header)) {
+      return obj_ptr->file_path;
+    }
+    size = MHEADER_SIZE;
+  }
+  else if (size < sizeof(header) || pread(file->fd, &header, sizeof(header), 0) != sizeof(header) ||
+           memcmp(header.magic, MHEADER_MAGIC, sizeof(header.magic)) != 0) {
+    return NULL;
+  }
+
+  if (header.version != MHEADER_VERSION) return "The version of the header is not supported";
+  if (header.checksum != MChecksum(&header, offsetof(MHeader, checksum)) ||
+      header.header_size < sizeof(header) ||
+      size < header.header_size || header.value_size == 0 || 0x100 <= header.value_size ||
+      memchr(header.value_type, '\0', sizeof(header.value_type)) == NULL) {
+    return "The header is broken";
+  }
+  if (header.header_size % page_size != 0) return "The header size is not a multiple of the page size";
+  int type = MLookupType(header.value_type);
+  if (type < 0 || (MTypeTable[type].value_size != 0 && MTypeTable[type].value_size != header.value_size)) {
+    return "The header is broken";
+  }
+  MCommit commit;
+  if (!MLatestCommit(&header, size - header.header_size, &commit)) return "The header is broken";
+
+  int prot = file->writable ? PROT_READ | PROT_WRITE : PROT_READ;
+  file->header = mmap(NULL, sizeof(MHeader), prot, MAP_SHARED, file->fd, 0);
+  if (file->header == MAP_FAILED) {
+    file->header = NULL;
+    return obj_ptr->file_path;
+  }
+  // values past the last commit were torn by a crash
+  file->offset = header.header_size;
+  file->capacity = size - header.header_size;
+  file->file_size = commit.count * header.value_size;
+  file->commit_seq = commit.seq;
+  file->committed_size = file->file_size;
+  return NULL;
+}
+
+// take value_type and value_size of obj_ptr from the header of its file, or check them against it
+static const char *MMatchHeader(MMapObject *obj_ptr, const MFile *file)
+{
+  if (file->header == NULL) {
+    if (obj_ptr->ops == NULL) return "The file has no header, value_type is needed";
+    if (obj_ptr->header) return "The file has no header";
+    return NULL;
+  }
+  int type = MLookupType(file->header->value_type);
+  if (obj_ptr->ops == NULL) {
+    obj_ptr->value_type = (MValueType)type;
+    obj_ptr->ops = &MTypeTable[type];
+    obj_ptr->value_size = file->header->value_size;
+    return NULL;
+  }
+  if (obj_ptr->value_type != (MValueType)type || obj_ptr->value_size != file->header->value_size) {
+    return "value_type or value_size doesn't match the header";
+  }
+  return NULL;
+}
+
+// reopen a file shared by read-only keys for a writable key
+// fd is opened read-write, and is owned by file on success
+static int MUpgradeFile(MFile *file, int fd)
+{
+  file->writable = true;
+  int old_fd = file->fd;
+  file->fd = fd;
+  void *addr = MMapFile(file);
+  MHeader *header = NULL;
+  if (file->header != NULL) {
+    header = mmap(NULL, sizeof(MHeader), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  }
+  if (addr == MAP_FAILED || header == MAP_FAILED ||
+      (file->header == NULL && MOpenSidecar(file) == -1)) {
+    if (addr != MAP_FAILED && addr != NULL) munmap(addr, file->capacity);
+    if (header != MAP_FAILED && header != NULL) munmap(header, sizeof(MHeader));
+    file->writable = false;
+    file->fd = old_fd;
+    return -1;
+  }
+  if (header != NULL) {
+    munmap(file->header, sizeof(MHeader));
+    file->header = header;
+  }
+  if (file->snapshot != NULL) {
+    // retire the read-only mapping, its last reader unmaps it
+    --file->snapshot->refs;
+    file->snapshot = NULL;
+  }
+  else if (file->mmap != NULL) munmap(file->mmap, file->capacity);
+  file->mmap = addr;
+  close(old_fd);
+  return 0;
+}
+
+static pthread_mutex_t MFlushLock = PTHREAD_MUTEX_INITIALIZER;
+static long long MLastFlush = 0;  // time of the last flush, guarded by MFlushLock
+
+// Writes are recorded in blocks of MDIRTY_BLOCK bytes of the values, each with the epoch of its
+// last write. A reader of the changes, the flusher or VDIRTY, takes an epoch when it reads them,
+// and the blocks with a later epoch are the ones written since.
+#define MDIRTY_BLOCK (64 << 10)
+
+// start a new epoch of file, and return the last one
+static uint64_t MTakeEpoch(MFile *file)
+{
+  return file->epoch++;
+}
+
+// record that len bytes from offset of file are written in the current epoch
+static void MMarkBlocks(MFile *file, size_t offset, size_t len)
+{
+  if (len == 0) return;
+  size_t first = offset / MDIRTY_BLOCK;
+  size_t last = (offset + len - 1) / MDIRTY_BLOCK;
+  if (file->blocks <= last) {
+    size_t blocks = file->capacity / MDIRTY_BLOCK + 1;
+    if (blocks <= last) blocks = last + 1;
+    file->epochs = zrealloc(file->epochs, sizeof(uint64_t) * blocks);
+    memset(file->epochs + file->blocks, 0, sizeof(uint64_t) * (blocks - file->blocks));
+    file->blocks = blocks;
+  }
+  for (size_t block = first; block <= last; ++block) file->epochs[block] = file->epoch;
+}
+
+// drop the values of obj_ptr from file_size, recording the dropped tail as written
+static void MTruncate(MMapObject *obj_ptr, size_t file_size)
+{
+  MFile *file = obj_ptr->file;
+  if (file_size < file->file_size) {
+    MMarkBlocks(file, file_size, file->file_size - file_size);
+    if (file->dropped_end < file->file_size) file->dropped_end = file->file_size;
+  }
+  MSetFileSize(obj_ptr, file_size);
+}
+
+// add the blocks between start and end of file written after epoch since to list
+static void MDirtyRuns(const MFile *file, uint64_t since, size_t start, size_t end, MRunList *list)
+{
+  if (file->blocks * MDIRTY_BLOCK < end) end = file->blocks * MDIRTY_BLOCK;
+  for (size_t block = start / MDIRTY_BLOCK; block * MDIRTY_BLOCK < end; ++block) {
+    if (since < file->epochs[block]) MAddRun(list, block * MDIRTY_BLOCK, MDIRTY_BLOCK);
+  }
+}
+
+// write the blocks in runs and the logical size to the disk
+// mapping holds the file while it is flushed off the main thread
+// the size in a header is committed after this, see MCommitHeader
+static void MSyncFile(MFile *file, const MMapping *mapping, const MRunList *runs, bool resized)
+{
+  for (size_t i = 0; i < runs->len; ++i) {
+    size_t start = runs->runs[i].offset;
+    size_t end = start + runs->runs[i].len;
+    if (mapping->capacity < end) end = mapping->capacity;
+    if (start < end) msync((char *)mapping->addr + start, end - start, MS_SYNC);
+  }
+  if (resized && file->size_ptr != NULL) msync(file->size_ptr, sizeof(uint64_t), MS_SYNC);
+}
+
+static void MSettleFlushes(MFile *file);
+
+// flush file on the main thread
+// the flushes queued for the file are run first, since they hold the blocks written before
+// a pending commit is written after the values, so that it never covers values which aren't on the disk
+static void MSyncFileNow(MFile *file)
+{
+  MSettleFlushes(file);
+  if (file->dirty_since != 0) {
+    MMapping mapping = {file->mmap, file->capacity, 0};
+    MRunList runs = {NULL, 0, 0};
+    MDirtyRuns(file, file->synced_epoch, file->dirty_start, file->dirty_end, &runs);
+    file->synced_epoch = MTakeEpoch(file);
+    MSyncFile(file, &mapping, &runs, file->file_size != file->synced_size);
+    zfree(runs.runs);
+    file->synced_size = file->file_size;
+    file->dirty_since = 0;
+    pthread_mutex_lock(&MFlushLock);
+    MLastFlush = RedisModule_Milliseconds();
+    pthread_mutex_unlock(&MFlushLock);
+  }
+  if (file->commit_pending) {
+    MCommitHeader(file, file->file_size, file->capacity);
+    file->commit_pending = false;
+    msync(file->header, sizeof(MHeader), MS_SYNC);
+  }
+}
+
+// close a file which has no references left
+static void MFinishClose(MFile *file)
+{
+  for (MFile **p = &MFiles; *p != NULL; p = &(*p)->next) {
+    if (*p == file) {
+      *p = file->next;
+      break;
+    }
+  }
+  if (file->mmap != NULL) munmap(file->mmap, file->capacity);
+  if (file->header != NULL) {
+    // drop the spare capacity
+    if (file->writable && ftruncate(file->fd, file->offset + file->file_size) == 0) {
+      file->capacity = file->file_size;
+      MCommitHeader(file, file->file_size, file->capacity);
+    }
+    munmap(file->header, sizeof(MHeader));
+  }
+  if (file->size_ptr != NULL) {
+    // drop the spare capacity, then the file size is the logical size again
+    munmap(file->size_ptr, sizeof(uint64_t));
+    if (ftruncate(file->fd, file->file_size) == 0) {
+      sds sidecar_path = MSidecarPath(file->path);
+      unlink(sidecar_path);
+      sdsfree(sidecar_path);
+    }
+  }
+  close(file->fd);
+  sdsfree(file->path);
+  zfree(file->epochs);
+  zfree(file);
+}
+
+// drop a key's reference to file, and close it with the last one
+// while a fork child reads it, the file is left open until the child exits or a key opens it again
+static void MCloseFile(MFile *file)
+{
+  if (--file->refs > 0) return;
+  MSyncFileNow(file);
+  if (!MChildActive()) MFinishClose(file);
+}
+
+// apply the shrink which waited for the readers or the fork child
+// it stays pending if one of them is still there
+static void MApplyShrink(MFile *file)
+{
+  if (!file->shrink_pending) return;
+  // the file may have grown since
+  size_t capacity = file->shrink_to < file->file_size ? file->file_size : file->shrink_to;
+  if (MResizeFile(file, capacity) == 0 && file->capacity == capacity) file->shrink_pending = false;
+}
+
+// close the files and apply the shrinks which waited for the fork child
+static void MForkChildEvent(RedisModuleCtx *ctx, RedisModuleEvent e, uint64_t sub, void *data)
+{
+  REDISMODULE_NOT_USED(ctx);
+  REDISMODULE_NOT_USED(e);
+  REDISMODULE_NOT_USED(data);
+  if (sub != REDISMODULE_SUBEVENT_FORK_CHILD_DIED) return;
+  MFile *next;
+  for (MFile *file = MFiles; file != NULL; file = next) {
+    next = file->next;
+    if (file->refs == 0) {
+      MFinishClose(file);
+      continue;
+    }
+    MApplyShrink(file);
+  }
+}
+
+// open and map obj_ptr->file_path, or share it with the keys that already have
+// file_path, writable, follow and header must be set. value_type, ops and value_size are taken
+// from the header of the file if ops is NULL
+// return NULL on success, otherwise an error message
+static const char *MOpenFile(MMapObject *obj_ptr)
+{
+  int fd;
+  if (obj_ptr->writable) {
+    fd = open(obj_ptr->file_path, O_RDWR | O_CREAT, 0666);
+  }
+  else {
+    fd = open(obj_ptr->file_path, O_RDONLY);
+  }
+  if (fd == -1) return obj_ptr->file_path;
+  struct stat sb;
+  if (fstat(fd, &sb) == -1) {
+    close(fd);
+    return obj_ptr->file_path;
+  }
+
+  const char *err;
+  for (MFile *file = MFiles; file != NULL; file = file->next) {
+    if (file->dev != sb.st_dev || file->ino != sb.st_ino) continue;
+    if ((err = MMatchHeader(obj_ptr, file)) != NULL) {
+      close(fd);
+      return err;
+    }
+    if (obj_ptr->writable && !file->writable) {
+      if (MUpgradeFile(file, fd) == -1) {
+        close(fd);
+        return obj_ptr->file_path;
+      }
+    }
+    else close(fd);
+    ++file->refs;
+    if (obj_ptr->follow) ++file->follows;
+    obj_ptr->file = file;
+    obj_ptr->dirty_epoch = MTakeEpoch(file);
+    return NULL;
+  }
+
+  MFile *file = zcalloc(sizeof(MFile));
+  file->dev = sb.st_dev;
+  file->ino = sb.st_ino;
+  file->fd = fd;
+  file->writable = obj_ptr->writable;
+  file->capacity = sb.st_size;
+  file->file_size = sb.st_size;
+  file->refs = 1;
+  file->follows = obj_ptr->follow ? 1 : 0;
+  file->epoch = 1;
+  file->path = sdsdup(obj_ptr->file_path);
+  err = MOpenHeader(file, obj_ptr, sb.st_size);
+  if (err == NULL) err = MMatchHeader(obj_ptr, file);
+  if (err == NULL && file->header == NULL && MOpenSidecar(file) == -1) err = obj_ptr->file_path;
+  if (err == NULL && (file->mmap = MMapFile(file)) == MAP_FAILED) err = obj_ptr->file_path;
+  if (err != NULL) {
+    if (file->header != NULL) munmap(file->header, sizeof(MHeader));
+    if (file->size_ptr != NULL) munmap(file->size_ptr, sizeof(uint64_t));
+    close(fd);
+    sdsfree(file->path);
+    zfree(file);
+    return err;
+  }
+  file->synced_size = file->file_size;
+  file->next = MFiles;
+  MFiles = file;
+  obj_ptr->file = file;
+  obj_ptr->dirty_epoch = MTakeEpoch(file);
+  return NULL;
+}
+
+RedisModuleType *MMapType = NULL;
+
+MMapObject *MCreateObject(void)
+{
+  return zcalloc(sizeof(MMapObject));
+}
+
+static pthread_t MMainThread;
+static pthread_mutex_t MFreeLock = PTHREAD_MUTEX_INITIALIZER;
+static MMapObject *MFreeQueue = NULL;  // guarded by MFreeLock
+
+// a lazy flush (FLUSHALL ASYNC, replica-lazy-flush) frees the keys on a background thread,
+// so they are queued for the main thread, which owns the files, see MCronEvent
+void MFree(void *value)
+{
+  if (value == NULL) return;
+  MMapObject *obj_ptr = value;
+  if (!pthread_equal(pthread_self(), MMainThread)) {
+    pthread_mutex_lock(&MFreeLock);
+    obj_ptr->next_free = MFreeQueue;
+    MFreeQueue = obj_ptr;
+    pthread_mutex_unlock(&MFreeLock);
+    return;
+  }
+  // the last reader frees it
+  if (obj_ptr->pins > 0) {
+    obj_ptr->freed = true;
+    return;
+  }
+  if (obj_ptr->file != NULL) {
+    if (obj_ptr->follow) --obj_ptr->file->follows;
+    MCloseFile(obj_ptr->file);
+  }
+  sdsfree(obj_ptr->file_path);
+  zfree(value);
+}
+
+// free the keys queued by MFree
+static void MDrainFreeQueue(void)
+{
+  pthread_mutex_lock(&MFreeLock);
+  MMapObject *queue = MFreeQueue;
+  MFreeQueue = NULL;
+  pthread_mutex_unlock(&MFreeLock);
+  while (queue != NULL) {
+    MMapObject *obj_ptr = queue;
+    queue = obj_ptr->next_free;
+    MFree(obj_ptr);
+  }
+}
+
+static void MCronEvent(RedisModuleCtx *ctx, RedisModuleEvent e, uint64_t sub, void *data)
+{
+  REDISMODULE_NOT_USED(ctx);
+  REDISMODULE_NOT_USED(e);
+  REDISMODULE_NOT_USED(sub);
+  REDISMODULE_NOT_USED(data);
+  MDrainFreeQueue();
+}
+
+// Following files
+// another process appends to a read-only file, and a timer extends its mapping and logical size
+
+static RedisModuleTimerID MFollowTimer;
+static bool MFollowArmed = false;
+
+// pick up the size of a file written by another process
+static void MFollowFile(MFile *file)
+{
+  struct stat sb;
+  if (fstat(file->fd, &sb) == -1 || (size_t)sb.st_size < file->offset) return;
+  size_t capacity = sb.st_size - file->offset;
+  if (file->capacity < capacity && MRemapFile(file, capacity) == -1) return;
+  if (file->header != NULL) {
+    MCommit commit;
+    if (MLatestCommit(file->header, capacity, &commit)) {
+      file->file_size = commit.count * file->header->value_size;
+    }
+    return;
+  }
+  // a writer with spare capacity keeps the logical size in the sidecar
+  uint64_t file_size = capacity;
+  sds sidecar_path = MSidecarPath(file->path);
+  int sidecar_fd = open(sidecar_path, O_RDONLY);
+  sdsfree(sidecar_path);
+  if (sidecar_fd != -1) {
+    uint64_t sidecar_size;
+    if (pread(sidecar_fd, &sidecar_size, sizeof(sidecar_size), 0) == sizeof(sidecar_size) &&
+        sidecar_size <= capacity) {
+      file_size = sidecar_size;
+    }
+    close(sidecar_fd);
+  }
+  // a truncated file keeps its mapping, but values past the end of the file can't be read
+  file->file_size = file_size;
+}
+
+static void MFollowTick(RedisModuleCtx *ctx, void *data)
+{
+  REDISMODULE_NOT_USED(data);
+  MFollowArmed = false;
+  for (MFile *file = MFiles; file != NULL; file = file->next) {
+    // the keys of a writable file grow it themselves
+    if (file->follows == 0 || file->writable) continue;
+    MFollowFile(file);
+    MFollowArmed = true;
+  }
+  if (MFollowArmed) MFollowTimer = RedisModule_CreateTimer(ctx, MFollowInterval, MFollowTick, NULL);
+}
+
+static void MFollowStart(RedisModuleCtx *ctx)
+{
+  if (MFollowArmed) return;
+  MFollowTimer = RedisModule_CreateTimer(ctx, MFollowInterval, MFollowTick, NULL);
+  MFollowArmed = true;
+}
+
+// hold the current mapping of obj_ptr for a reader
+// it stays mapped across remaps, and obj_ptr stays even if the key is deleted
+static MMapping *MPinFile(MFile *file)
+{
+  if (file->snapshot == NULL) {
+    file->snapshot = zmalloc(sizeof(MMapping));
+    file->snapshot->addr = file->mmap;
+    file->snapshot->capacity = file->capacity;
+    file->snapshot->refs = 1;
+  }
+  ++file->snapshot->refs;
+  ++file->pins;
+  return file->snapshot;
+}
+
+static void MUnpinFile(MFile *file, MMapping *mapping)
+{
+  if (--mapping->refs == 0) {
+    // retired by a remap
+    if (mapping->addr != NULL) munmap(mapping->addr, mapping->capacity);
+    zfree(mapping);
+  }
+  else if (mapping == file->snapshot && mapping->refs == 1) {
+    // only the key holds the current mapping
+    zfree(mapping);
+    file->snapshot = NULL;
+  }
+  // the last reader applies the shrink, unless the file is being closed
+  if (--file->pins == 0 && file->refs > 0 && !MChildActive()) MApplyShrink(file);
+}
+
+static MMapping *MAcquire(MMapObject *obj_ptr)
+{
+  ++obj_ptr->pins;
+  return MPinFile(obj_ptr->file);
+}
+
+static void MRelease(MMapObject *obj_ptr, MMapping *mapping)
+{
+  MUnpinFile(obj_ptr->file, mapping);
+  if (--obj_ptr->pins == 0 && obj_ptr->freed) MFree(obj_ptr);
+}
+
+// Flushing
+// Writes mark the range they change, and the policy of the fsync parameter flushes it:
+// always on the main thread before the reply, everysec on the flusher thread.
+// A write with sync blocks its client until the next flush of the file, so that the writes
+// arriving during a flush are committed together by the one after it.
+
+typedef struct _MSyncWaiter
+{
+  RedisModuleBlockedClient *bc;
+  long long reply;
+  struct _MSyncWaiter *next;
+} MSyncWaiter;
+
+typedef struct _MFlush
+{
+  MFile *file;          // open until its flushes are settled, see MSettleFlushes
+  MMapping *mapping;
+  size_t start;         // the range of the blocks
+  size_t end;
+  uint64_t from;        // the blocks written after this epoch are flushed
+  MRunList runs;
+  bool resized;
+  bool commit;          // commit_size to the header after the values, see MRunFlush
+  size_t commit_size;
+  size_t commit_capacity;
+  long long since;      // 0 if nothing was written
+  MSyncWaiter *waiters;
+  struct _MFlush *next;
+} MFlush;
+
+static pthread_cond_t MFlushCond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t MFlushDoneCond = PTHREAD_COND_INITIALIZER;
+static MFlush *MFlushes = NULL;     // waiting for the flusher, guarded by MFlushLock
+static MFlush *MFlushing = NULL;    // being flushed, guarded by MFlushLock
+static MFlush *MFlushed = NULL;     // done, released by the next tick or MSettleFlushes, guarded by MFlushLock
+static int MFlushesInFlight = 0;    // main thread only
+static bool MFlushArmed = false;
+
+// flush the values, then commit their number to the header, and wake the clients waiting for them
+static void MRunFlush(MFlush *flush)
+{
+  MFile *file = flush->file;
+  MSyncFile(file, flush->mapping, &flush->runs, flush->resized);
+  if (flush->commit) {
+    MCommitHeader(file, flush->commit_size, flush->commit_capacity);
+    msync(file->header, sizeof(MHeader), MS_SYNC);
+  }
+  for (MSyncWaiter *waiter = flush->waiters; waiter != NULL;) {
+    MSyncWaiter *next = waiter->next;
+    RedisModule_UnblockClient(waiter->bc, waiter);
+    waiter = next;
+  }
+}
+
+static void *MFlushWorker(void *arg)
+{
+  pthread_mutex_lock(&MFlushLock);
+  for (;;) {
+    if (MFlushes == NULL) {
+      pthread_cond_wait(&MFlushCond, &MFlushLock);
+      continue;
+    }
+    MFlush *flush = MFlushes;
+    MFlushes = flush->next;
+    // the writes from now on go to the next flush
+    flush->file->queued = NULL;
+    MFlushing = flush;
+    pthread_mutex_unlock(&MFlushLock);
+    MRunFlush(flush);
+    pthread_mutex_lock(&MFlushLock);
+    MFlushing = NULL;
+    flush->next = MFlushed;
+    MFlushed = flush;
+    MLastFlush = RedisModule_Milliseconds();
+    pthread_cond_broadcast(&MFlushDoneCond);
+  }
+  return NULL;
+}
+
+// hand what was written to file since its last flush to the flusher thread,
+// adding it to the flush which is queued for the file if any
+// it is returned with MFlushLock held
+static MFlush *MQueueFlush(MFile *file)
+{
+  pthread_mutex_lock(&MFlushLock);
+  MFlush *flush = file->queued;
+  if (flush == NULL) {
+    flush = zcalloc(sizeof(MFlush));
+    flush->file = file;
+    flush->mapping = MPinFile(file);
+    flush->start = SIZE_MAX;
+    flush->from = file->synced_epoch;
+    MFlush **last = &MFlushes;
+    while (*last != NULL) last = &(*last)->next;
+    *last = flush;
+    file->queued = flush;
+    ++MFlushesInFlight;
+    pthread_cond_signal(&MFlushCond);
+  }
+  else if (flush->mapping != file->snapshot) {
+    // remapped since it was queued, the range may be past the old mapping
+    MMapping *mapping = MPinFile(file);
+    MUnpinFile(file, flush->mapping);
+    flush->mapping = mapping;
+  }
+  if (file->dirty_since != 0) {
+    if (file->dirty_start < flush->start) flush->start = file->dirty_start;
+    if (flush->end < file->dirty_end) flush->end = file->dirty_end;
+    // collected again, since the blocks may have been written again after the flush was queued
+    flush->runs.len = 0;
+    MDirtyRuns(file, flush->from, flush->start, flush->end, &flush->runs);
+    file->synced_epoch = MTakeEpoch(file);
+    if (file->file_size != file->synced_size) flush->resized = true;
+    if (flush->since == 0) flush->since = file->dirty_since;
+    file->synced_size = file->file_size;
+    file->dirty_since = 0;
+  }
+  if (file->commit_pending) {
+    // the flush holds the values up to the current size, so the flusher commits it after them
+    flush->commit = true;
+    flush->commit_size = file->file_size;
+    flush->commit_capacity = file->capacity;
+    file->commit_pending = false;
+  }
+  return flush;
+}
+
+static void MFreeFlush(MFlush *flush)
+{
+  MUnpinFile(flush->file, flush->mapping);
+  zfree(flush->runs.runs);
+  zfree(flush);
+  --MFlushesInFlight;
+}
+
+// take the flushes of file back from the flusher before the file is closed, so that it is
+// closed with its last key. the running one is waited for, and the queued ones are run here
+static void MSettleFlushes(MFile *file)
+{
+  pthread_mutex_lock(&MFlushLock);
+  while (MFlushing != NULL && MFlushing->file == file) pthread_cond_wait(&MFlushDoneCond, &MFlushLock);
+  MFlush *queued = NULL, *flushed = NULL;
+  for (MFlush **p = &MFlushes; *p != NULL;) {
+    MFlush *flush = *p;
+    if (flush->file != file) {
+      p = &flush->next;
+      continue;
+    }
+    *p = flush->next;
+    flush->next = queued;
+    queued = flush;
+  }
+  for (MFlush **p = &MFlushed; *p != NULL;) {
+    MFlush *flush = *p;
+    if (flush->file != file) {
+      p = &flush->next;
+      continue;
+    }
+    *p = flush->next;
+    flush->next = flushed;
+    flushed = flush;
+  }
+  file->queued = NULL;
+  pthread_mutex_unlock(&MFlushLock);
+
+  while (queued != NULL) {
+    MFlush *flush = queued;
+    queued = flush->next;
+    MRunFlush(flush);
+    MFreeFlush(flush);
+  }
+  while (flushed != NULL) {
+    MFlush *flush = flushed;
+    flushed = flush->next;
+    MFreeFlush(flush);
+  }
+}
+
+// release the flushed files, and hand the dirty ones to the flusher every second
+static void MFlushTick(RedisModuleCtx *ctx, void *data)
+{
+  REDISMODULE_NOT_USED(data);
+  pthread_mutex_lock(&MFlushLock);
+  MFlush *flushed = MFlushed;
+  MFlushed = NULL;
+  pthread_mutex_unlock(&MFlushLock);
+  while (flushed != NULL) {
+    MFlush *flush = flushed;
+    flushed = flush->next;
+    MFreeFlush(flush);
+  }
+
+  for (MFile *file = MFiles; file != NULL; file = file->next) {
+    if (file->dirty_since == 0) continue;
+    MQueueFlush(file);
+    pthread_mutex_unlock(&MFlushLock);
+  }
+
+  MFlushArmed = MFlushesInFlight > 0;
+  if (MFlushArmed) RedisModule_CreateTimer(ctx, 1000, MFlushTick, NULL);
+}
+
+static void MFlushArm(RedisModuleCtx *ctx)
+{
+  if (MFlushArmed) return;
+  RedisModule_CreateTimer(ctx, 1000, MFlushTick, NULL);
+  MFlushArmed = true;
+}
+
+// hand the blocks written between offset and offset + len of obj_ptr, or its logical size,
+// to the flusher as the policy says. the blocks must be marked by MMarkBlocks
+// with sync, the range is recorded whatever the policy is, and MReplySynced flushes it
+// a new size of a file with a header is committed after its values reach the disk, so even
+// with fsync no it is flushed by the flusher, see MQueueFlush
+static void MMarkFlush(RedisModuleCtx *ctx, MMapObject *obj_ptr, size_t offset, size_t len, bool sync)
+{
+  MFile *file = obj_ptr->file;
+  if (MFsyncPolicy == MFSYNC_NO && !sync && !file->commit_pending) return;
+  if (file->dirty_since == 0) {
+    file->dirty_start = SIZE_MAX;
+    file->dirty_end = 0;
+    file->dirty_since = RedisModule_Milliseconds();
+  }
+  if (len > 0) {
+    if (offset < file->dirty_start) file->dirty_start = offset;
+    if (file->dirty_end < offset + len) file->dirty_end = offset + len;
+  }
+  if (sync) return;
+  if (MFsyncPolicy == MFSYNC_ALWAYS) {
+    MSyncFileNow(file);
+    return;
+  }
+  MFlushArm(ctx);
+}
+
+// record that len bytes from offset of obj_ptr, or its logical size, have been written
+static void MMarkDirty(RedisModuleCtx *ctx, MMapObject *obj_ptr, size_t offset, size_t len, bool sync)
+{
+  MMarkBlocks(obj_ptr->file, offset, len);
+  MMarkFlush(ctx, obj_ptr, offset, len, sync);
+}
+
+static int MSyncReply(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
+{
+  MSyncWaiter *waiter = RedisModule_GetBlockedClientPrivateData(ctx);
+  return RedisModule_ReplyWithLongLong(ctx, waiter->reply);
+}
+
+static void MSyncFree(RedisModuleCtx *ctx, void *privdata)
+{
+  zfree(privdata);
+}
+
+// reply to a write with sync once what was written to obj_ptr is on the disk
+static int MReplySynced(RedisModuleCtx *ctx, MMapObject *obj_ptr, long long reply)
+{
+  if (!MCanBlockClient(ctx)) {
+    MSyncFileNow(obj_ptr->file);
+    return RedisModule_ReplyWithLongLong(ctx, reply);
+  }
+  MSyncWaiter *waiter = zmalloc(sizeof(MSyncWaiter));
+  waiter->bc = RedisModule_BlockClient(ctx, MSyncReply, NULL, MSyncFree, 0);
+  waiter->reply = reply;
+  MFlush *flush = MQueueFlush(obj_ptr->file);
+  waiter->next = flush->waiters;
+  flush->waiters = waiter;
+  pthread_mutex_unlock(&MFlushLock);
+  MFlushArm(ctx);
+  return REDISMODULE_OK;
+}
+
+// the age in milliseconds of the oldest write which isn't on the disk
+static long long MFlushLag(void)
+{
+  long long oldest = 0;
+  for (MFile *file = MFiles; file != NULL; file = file->next) {
+    if (file->dirty_since != 0 && (oldest == 0 || file->dirty_since < oldest)) oldest = file->dirty_since;
+  }
+  pthread_mutex_lock(&MFlushLock);
+  for (MFlush *flush = MFlushes; flush != NULL; flush = flush->next) {
+    if (flush->since != 0 && (oldest == 0 || flush->since < oldest)) oldest = flush->since;
+  }
+  if (MFlushing != NULL && MFlushing->since != 0 &&
+      (oldest == 0 || MFlushing->since < oldest)) {
+    oldest = MFlushing->since;
+  }
+  pthread_mutex_unlock(&MFlushLock);
+  return oldest == 0 ? 0 : RedisModule_Milliseconds() - oldest;
+}
+
+void MInfo(RedisModuleInfoCtx *ctx, int for_crash_report)
+{
+  REDISMODULE_NOT_USED(for_crash_report);
+  RedisModule_InfoAddSection(ctx, "fsync");
+  RedisModule_InfoAddFieldCString(ctx, "policy", (char *)MFsyncNames[MFsyncPolicy]);
+  pthread_mutex_lock(&MFlushLock);
+  long long last_flush = MLastFlush;
+  pthread_mutex_unlock(&MFlushLock);
+  RedisModule_InfoAddFieldLongLong(ctx, "last_flush", last_flush);
+  RedisModule_InfoAddFieldLongLong(ctx, "lag", MFlushLag());
+  RedisModule_InfoAddSection(ctx, "pagein");
+  RedisModule_InfoAddFieldLongLong(ctx, "pageins", MPageInCount);
+  RedisModule_InfoAddFieldLongLong(ctx, "pagein_bytes", MPageInBytes);
+}
+
+// Replication
+// Writes reach the replicas and the AOF as binary deltas at fixed positions: VADDRAWAT for appends,
+// VSETRAW and VMSETRAW for overwrites and VTRUNCATE for pops. An AOF with an RDB preamble is replayed
+// on the file as it is at the end, so the deltas must not depend on the count they are replayed on.
+// They are propagated by the command itself, before its reply is sent.
+
+// propagate len bytes of values appended to key at index
+static void MReplicateAppend(RedisModuleCtx *ctx, RedisModuleString *key, size_t index,
+                             const char *values, size_t len)
+{
+  RedisModule_Replicate(ctx, "VADDRAWAT", "slb", key, (long long)index, values, len);
+}
+
+// propagate the command as it is
+static void MReplicateCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
+{
+  RedisModule_Replicate(ctx, RedisModule_StringPtrLen(argv[0], NULL), "v", argv + 1, (size_t)(argc - 1));
+}
+
+typedef enum _MAggregateKind
+{
+  MAGG_SUM,
+  MAGG_MIN,
+  MAGG_MAX,
+  MAGG_MEAN,
+  MAGG_STDDEV
+} MAggregateKind;
+
+static const char *MAggregateNames[] = {"VSUM", "VMIN", "VMAX", "VMEAN", "VSTDDEV"};
+
+// reply a result which is an integer for integer types, if it fits in long long
+static int MReplyAggregateValue(RedisModuleCtx *ctx, const MMapObject *obj_ptr, long double value)
+{
+  if (obj_ptr->value_type <= MTYPE_UINT64 && LLONG_MIN <= value && value <= LLONG_MAX) {
+    return RedisModule_ReplyWithLongLong(ctx, (long long)value);
+  }
+  if (obj_ptr->value_type == MTYPE_LONG_DOUBLE) return RedisModule_ReplyWithLongDouble(ctx, value);
+  return RedisModule_ReplyWithDouble(ctx, (double)value);
+}
+
+static long double MAggregateSum(const MMapObject *obj_ptr, const MAggregate *agg)
+{
+  return obj_ptr->value_type <= MTYPE_UINT64 ? (long double)agg->isum : agg->sum;
+}
+
+// reply the result of kind over n > 0 elements
+// deviation is the sum of squared deviations from the mean, used only by VSTDDEV
+static int MReplyAggregate(RedisModuleCtx *ctx, const MMapObject *obj_ptr, MAggregateKind kind,
+                           const MAggregate *agg, size_t n, long double deviation)
+{
+  switch (kind) {
+  case MAGG_SUM:
+    return MReplyAggregateValue(ctx, obj_ptr, MAggregateSum(obj_ptr, agg));
+  case MAGG_MIN:
+    return MReplyAggregateValue(ctx, obj_ptr, agg->min);
+  case MAGG_MAX:
+    return MReplyAggregateValue(ctx, obj_ptr, agg->max);
+  case MAGG_MEAN:
+    return RedisModule_ReplyWithDouble(ctx, (double)(MAggregateSum(obj_ptr, agg) / n));
+  case MAGG_STDDEV:
+    // population standard deviation
+    return RedisModule_ReplyWithDouble(ctx, sqrt((double)(deviation / n)));
+  }
+  return REDISMODULE_ERR;
+}
+
+// Background jobs
+// A job splits its range into morsels, which the worker threads take in turn.
+// The key is pinned while the job runs and the client is unblocked when the last morsel is done.
+// VSTDDEV takes two passes over the morsels, the second one around the mean of the first.
+// Gather jobs (VMGET, VRANGE) copy the values into a buffer, which is replied on the main thread.
+
+#define MJOB_MORSEL (1 << 20)  // elements per morsel of aggregation
+#define MGATHER_MIN_MORSEL 4096
+
+typedef struct _MJob
+{
+  uint64_t id;
+  MMapObject *obj_ptr;
+  MMapping *mapping;
+  size_t count;         // values in the mapping when the job starts
+  RedisModuleBlockedClient *bc;
+  sds key_name;
+  const char *command;
+  MAggregateKind kind;
+  const char *values;   // first element of the range
+  size_t n;
+  size_t morsel_size;
+  size_t total_morsels;
+  size_t morsels;       // morsels to run in this pass, cut down on cancel
+  size_t next;          // next morsel to take
+  size_t done;          // morsels done in this pass
+  int pass;
+  bool cancelled;
+  bool finished;
+  double mean;
+  MAggregate *partials;
+  long double *deviations;
+  bool gather;
+  uint64_t *indices;    // gather these indices, or every step values from values
+  size_t step;
+  char *gathered;
+  struct _MJob *next_job;
+} MJob;
+
+// MJobs and all the fields of the jobs in it are guarded by MJobLock
+static MJob *MJobs = NULL;
+static uint64_t MNextJobId = 1;
+
+static void MMergeAggregate(MAggregate *agg, const MAggregate *part, bool first)
+{
+  agg->isum += part->isum;
+  agg->sum += part->sum;
+  if (first || part->min < agg->min) agg->min = part->min;
+  if (first || part->max > agg->max) agg->max = part->max;
+}
+
+// called with MJobLock held when all morsels of the pass are done
+static void MJobFinishPass(MJob *job)
+{
+  if (!job->cancelled && !job->gather && job->kind == MAGG_STDDEV && job->pass == 1) {
+    MAggregate agg = {0, 0, 0, 0};
+    for (size_t i = 0; i < job->morsels; ++i) MMergeAggregate(&agg, &job->partials[i], i == 0);
+    job->mean = (double)(MAggregateSum(job->obj_ptr, &agg) / job->n);
+    job->pass = 2;
+    job->next = job->done = 0;
+    pthread_cond_broadcast(&MJobCond);
+    return;
+  }
+  job->finished = true;
+  RedisModule_UnblockClient(job->bc, job);
+}
+
+static void MJobRunMorsel(MJob *job, int pass, size_t morsel)
+{
+  const MMapObject *obj_ptr = job->obj_ptr;
+  uint8_t value_size = obj_ptr->value_size;
+  size_t start = morsel * job->morsel_size;
+  size_t n = job->n - start < job->morsel_size ? job->n - start : job->morsel_size;
+  if (job->gather) {
+    char *out = job->gathered + start * value_size;
+    if (job->indices != NULL) {
+      MGather(job->mapping->addr, job->count, value_size, job->indices + start, n, out, true);
+    }
+    else if (job->step == 1) memcpy(out, job->values + start * value_size, n * value_size);
+    else {
+      for (size_t i = 0; i < n; ++i) {
+        memcpy(out + i * value_size, job->values + (start + i) * job->step * value_size, value_size);
+      }
+    }
+    return;
+  }
+  const char *values = job->values + start * value_size;
+  if (pass == 1) obj_ptr->ops->aggregate(values, n, &job->partials[morsel]);
+  else job->deviations[morsel] = obj_ptr->ops->deviation(values, n, job->mean);
+}
+
+static void *MJobWorker(void *arg)
+{
+  pthread_mutex_lock(&MJobLock);
+  for (;;) {
+    if (MPageIns != NULL) {
+      MPageIn *page_in = MPageIns;
+      MPageIns = page_in->next;
+      pthread_mutex_unlock(&MJobLock);
+      MPageInRun(page_in);
+      RedisModule_UnblockClient(page_in->bc, page_in);
+      pthread_mutex_lock(&MJobLock);
+      continue;
+    }
+    MJob *job = MJobs;
+    while (job != NULL && (job->finished || job->next == job->morsels)) job = job->next_job;
+    if (job == NULL) {
+      pthread_cond_wait(&MJobCond, &MJobLock);
+      continue;
+    }
+    size_t morsel = job->next++;
+    int pass = job->pass;
+    pthread_mutex_unlock(&MJobLock);
+    MJobRunMorsel(job, pass, morsel);
+    pthread_mutex_lock(&MJobLock);
+    if (++job->done == job->morsels) MJobFinishPass(job);
+  }
+  return NULL;
+}
+
+static int MJobReply(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
+{
+  MJob *job = RedisModule_GetBlockedClientPrivateData(ctx);
+  if (job->cancelled) return RedisModule_ReplyWithError(ctx, "The job is cancelled");
+  if (job->gather) {
+    // the reply keeps the types of the synchronous path, so it is formatted here value by value
+    uint8_t value_size = job->obj_ptr->value_size;
+    RedisModule_ReplyWithArray(ctx, job->n);
+    for (size_t i = 0; i < job->n; ++i) {
+      job->obj_ptr->ops->reply(ctx, job->gathered + i * value_size, value_size);
+    }
+    return REDISMODULE_OK;
+  }
+  MAggregate agg = {0, 0, 0, 0};
+  long double deviation = 0;
+  for (size_t i = 0; i < job->total_morsels; ++i) {
+    MMergeAggregate(&agg, &job->partials[i], i == 0);
+    if (job->kind == MAGG_STDDEV) deviation += job->deviations[i];
+  }
+  return MReplyAggregate(ctx, job->obj_ptr, job->kind, &agg, job->n, deviation);
+}
+
+static void MJobFree(RedisModuleCtx *ctx, void *privdata)
+{
+  MJob *job = privdata;
+  pthread_mutex_lock(&MJobLock);
+  for (MJob **p = &MJobs; *p != NULL; p = &(*p)->next_job) {
+    if (*p == job) {
+      *p = job->next_job;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&MJobLock);
+  MRelease(job->obj_ptr, job->mapping);
+  sdsfree(job->key_name);
+  zfree(job->partials);
+  zfree(job->deviations);
+  zfree(job->indices);
+  zfree(job->gathered);
+  zfree(job);
+}
+
+// a job over n elements of obj_ptr, split into morsels of morsel_size
+static MJob *MJobCreate(RedisModuleString *key_name, MMapObject *obj_ptr, const char *command,
+                        size_t n, size_t morsel_size)
+{
+  MJob *job = zcalloc(sizeof(MJob));
+  job->obj_ptr = obj_ptr;
+  job->mapping = MAcquire(obj_ptr);
+  job->count = MCount(obj_ptr);
+  job->key_name = sdsnew(RedisModule_StringPtrLen(key_name, NULL));
+  job->command = command;
+  job->n = n;
+  job->morsel_size = morsel_size;
+  job->total_morsels = (n + morsel_size - 1) / morsel_size;
+  job->morsels = job->total_morsels;
+  job->pass = 1;
+  return job;
+}
+
+// block the client and hand the morsels of job to the worker threads
+static void MJobSubmit(RedisModuleCtx *ctx, MJob *job)
+{
+  job->bc = RedisModule_BlockClient(ctx, MJobReply, NULL, MJobFree, 0);
+
+  pthread_mutex_lock(&MJobLock);
+  job->id = MNextJobId++;
+  MJob **tail = &MJobs;
+  while (*tail != NULL) tail = &(*tail)->next_job;
+  *tail = job;
+  pthread_cond_broadcast(&MJobCond);
+  pthread_mutex_unlock(&MJobLock);
+}
+
+// run kind over n elements from start in the background
+static void MJobStartAggregate(RedisModuleCtx *ctx, RedisModuleString *key_name, MMapObject *obj_ptr,
+                               MAggregateKind kind, size_t start, size_t n)
+{
+  MJob *job = MJobCreate(key_name, obj_ptr, MAggregateNames[kind], n, MJOB_MORSEL);
+  job->kind = kind;
+  job->values = MElement(obj_ptr, start);
+  job->partials = zcalloc(sizeof(MAggregate) * job->total_morsels);
+  if (kind == MAGG_STDDEV) job->deviations = zcalloc(sizeof(long double) * job->total_morsels);
+  MJobSubmit(ctx, job);
+}
+
+// gather n values in the background, at indices (taken over by the job) or every step from start
+// the values are split among gather-threads morsels at most
+static void MJobStartGather(RedisModuleCtx *ctx, RedisModuleString *key_name, MMapObject *obj_ptr,
+                            const char *command, uint64_t *indices, size_t start, size_t step, size_t n)
+{
+  long long threads = MGatherThreads > 0 && MGatherThreads < MThreads ? MGatherThreads : MThreads;
+  size_t morsel_size = (n + threads - 1) / threads;
+  if (morsel_size < MGATHER_MIN_MORSEL) morsel_size = MGATHER_MIN_MORSEL;
+  MJob *job = MJobCreate(key_name, obj_ptr, command, n, morsel_size);
+  job->gather = true;
+  job->indices = indices;
+  job->values = indices == NULL ? MElement(obj_ptr, start) : NULL;
+  job->step = step;
+  job->gathered = zmalloc(n * obj_ptr->value_size + 1);
+  MJobSubmit(ctx, job);
+}
+
+// MMAP key file_path [value_type [value_size]] [writable|follow] [header] [embed]
+int MMap_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
+{
+  RedisModule_AutoMemory(ctx); /* Use automatic memory management. */
+  if (argc < 3 || 8 < argc) return RedisModule_WrongArity(ctx);
+  bool writable = false;
+  bool follow = false;
+  bool header = false;
+  bool embed = false;
+  uint8_t value_size = 0;
+  long long tmp_size;
+  // value_type can be left to the header of the file
+  int value_type = argc > 3 ? MLookupType(RedisModule_StringPtrLen(argv[3], NULL)) : -1;
+  for (int i = value_type < 0 ? 3 : 4; i < argc; ++i) {
+    if (mstringcmp(argv[i], "writable") == 0) writable = true;
+    else if (mstringcmp(argv[i], "follow") == 0) follow = true;
+    else if (mstringcmp(argv[i], "header") == 0) header = true;
+    else if (mstringcmp(argv[i], "embed") == 0) embed = true;
+    else if (value_type >= 0 && i == 4 &&
+             RedisModule_StringToLongLong(argv[i], &tmp_size) == REDISMODULE_OK) {
+      if (tmp_size <= 0) {
+        return RedisModule_ReplyWithError(
+            ctx, "value_size must be positive");
+      }
+      if (0x100 <= tmp_size) {
+        return RedisModule_ReplyWithError(
+            ctx, "value_size must be between 1 and 255");
+      }
+      value_size = (uint8_t)tmp_size;
+    }
+    else if (i == 3) {
+      return RedisModule_ReplyWithError(
+        ctx, "value_type must be int8, uint8, int16, uint16, int32, uint32, int64, uint64, float, double, long_double or string");
+    }
+    else {
+      return RedisModule_ReplyWithError(
+          ctx, "Arguments must be \"writable\", \"follow\", \"header\", \"embed\" or integer");
+    }
+  }
+  if (writable && follow) {
+    return RedisModule_ReplyWithError(ctx, "A writable key can't follow the file");
+  }
+
+  // without value_type, it is taken from the header of the file
+  const MTypeOps *ops = value_type < 0 ? NULL : &MTypeTable[value_type];
+  if (ops != NULL && ops->value_size == 0) {
+    if (value_size == 0) {
+      return RedisModule_ReplyWithError(
+        ctx, "string type must has value_size");
+    }
+  }
+  else if (ops != NULL) {
+    if (value_size == 0) value_size = ops->value_size;
+    if (value_size != ops->value_size) {
+      return RedisModule_ReplyWithError(ctx, "invalid value_size");
+    }
+  }
+
+  RedisModuleKey *key = RedisModule_OpenKey(ctx, argv[1], REDISMODULE_READ | REDISMODULE_WRITE);
+  int type = RedisModule_KeyType(key);
+  if (type != REDISMODULE_KEYTYPE_EMPTY &&
+      RedisModule_ModuleTypeGetType(key) != MMapType) {
+    return RedisModule_ReplyWithError(ctx, REDISMODULE_ERRORMSG_WRONGTYPE);
+  }
+
+  /* Create an empty value object if the key is currently empty. */
+  MMapObject *obj_ptr;
+  if (type == REDISMODULE_KEYTYPE_EMPTY) {
+    obj_ptr = MCreateObject();
+    obj_ptr->file_path = sdsnew(RedisModule_StringPtrLen(argv[2], NULL));
+    obj_ptr->value_type = (MValueType)value_type;
+    obj_ptr->ops = ops;
+    obj_ptr->value_size = value_size;
+    obj_ptr->writable = writable;
+    obj_ptr->follow = follow;
+    obj_ptr->header = header;
+    obj_ptr->embed = embed;
+    const char *err = MOpenFile(obj_ptr);
+    if (err != NULL) {
+      int ret = RedisModule_ReplyWithError(ctx, err);
+      MFree(obj_ptr);
+      return ret;
+    }
+    if (follow) MFollowStart(ctx);
+    RedisModule_ModuleTypeSetValue(key, MMapType, obj_ptr);
+    MReplicateCommand(ctx, argv, argc);
+  }
+  else {
+    obj_ptr = RedisModule_ModuleTypeGetValue(key);
+    if (obj_ptr == NULL) {
+      RedisModule_ReplyWithNull(ctx);
+      return REDISMODULE_ERR;
+    }
+    if (strcmp(obj_ptr->file_path, RedisModule_StringPtrLen(argv[2], NULL)) != 0) {
+      return RedisModule_ReplyWithError(ctx, "It is already mapped on another file");
+    }
+  }
+
+  return RedisModule_ReplyWithLongLong(ctx, MCount(obj_ptr));
+}
+
+// VRELOAD key file_path [warm]
+int VReload_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
+{
+  RedisModule_AutoMemory(ctx); /* Use automatic memory management. */
+  if (argc < 3 || 4 < argc) return RedisModule_WrongArity(ctx);
+  bool warm = false;
+  if (argc == 4) {
+    if (mstringcmp(argv[3], "warm") != 0) {
+      return RedisModule_ReplyWithError(ctx, "Argument must be \"warm\"");
+    }
+    warm = true;
+  }
+
+  RedisModuleKey *key = RedisModule_OpenKey(ctx, argv[1], REDISMODULE_READ | REDISMODULE_WRITE);
+  int type = RedisModule_KeyType(key);
+  if (type != REDISMODULE_KEYTYPE_EMPTY &&
+      RedisModule_ModuleTypeGetType(key) != MMapType) {
+    return RedisModule_ReplyWithError(ctx, REDISMODULE_ERRORMSG_WRONGTYPE);
+  }
+
+  if (type == REDISMODULE_KEYTYPE_EMPTY) {
+    return RedisModule_ReplyWithError(ctx, "You must do MMAP first");
+  }
+
+  MMapObject *obj_ptr = RedisModule_ModuleTypeGetValue(key);
+  if (obj_ptr == NULL) {
+    return RedisModule_ReplyWithNull(ctx);
+  }
+
+  // the replay of a warm reload swaps in the mapping which was paged in
+  MMapObject *new_ptr = MPageInReload;
+  MPageInReload = NULL;
+  if (new_ptr == NULL) {
+    new_ptr = MCreateObject();
+    new_ptr->file_path = sdsnew(RedisModule_StringPtrLen(argv[2], NULL));
+    new_ptr->value_type = obj_ptr->value_type;
+    new_ptr->ops = obj_ptr->ops;
+    new_ptr->value_size = obj_ptr->value_size;
+    new_ptr->writable = obj_ptr->writable;
+    new_ptr->follow = obj_ptr->follow;
+    new_ptr->header = obj_ptr->header;
+    new_ptr->embed = obj_ptr->embed;
+    const char *err = MOpenFile(new_ptr);
+    if (err != NULL) {
+      int ret = RedisModule_ReplyWithError(ctx, err);
+      MFree(new_ptr);
+      return ret;
+    }
+
+    // read the new file into the page cache on a worker thread, then swap it in
+    if (warm && !MPageInReplay && MCanBlock(ctx)) {
+      MRunList list = {NULL, 0, 0};
+      MColdRange(new_ptr, 0, new_ptr->file->file_size, &list);
+      if (MPageInStart(ctx, new_ptr, &list, argv, argc, VReload_RedisCommand, new_ptr)) {
+        return REDISMODULE_OK;
+      }
+    }
+  }
+
+  // readers of the old mapping keep it until they are done, see MAcquire
+  void *old_ptr;
+  RedisModule_ModuleTypeReplaceValue(key, MMapType, new_ptr, &old_ptr);
+  MFree(old_ptr);
+  if (new_ptr->follow) MFollowStart(ctx);
+  // a replica needs no page in, and its master link must not block
+  RedisModule_Replicate(ctx, "VRELOAD", "ss", argv[1], argv[2]);
+  return RedisModule_ReplyWithLongLong(ctx, MCount(new_ptr));
+}
+
+// VGET key index
+int VGet_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
+{
+  RedisModule_AutoMemory(ctx); /* Use automatic memory management. */
+  if (argc != 3) return RedisModule_WrongArity(ctx);
+
+  RedisModuleKey *key =
+      RedisModule_OpenKey(ctx, argv[1], REDISMODULE_READ | REDISMODULE_WRITE);
+  int type = RedisModule_KeyType(key);
+  if (type != REDISMODULE_KEYTYPE_EMPTY &&
+      RedisModule_ModuleTypeGetType(key) != MMapType) {
+    return RedisModule_ReplyWithError(ctx, REDISMODULE_ERRORMSG_WRONGTYPE);
+  }
+
+  if (type == REDISMODULE_KEYTYPE_EMPTY) {
+    return RedisModule_ReplyWithError(ctx, "You must do MMAP first");
+  }
+
+  long long index;
+  if (RedisModule_StringToLongLong(argv[2], &index) == REDISMODULE_ERR) {
+    return RedisModule_ReplyWithError(ctx, "index argument must be integer");
+  }
+
+  MMapObject *obj_ptr = RedisModule_ModuleTypeGetValue(key);
+  if (obj_ptr == NULL) {
+    return REDISMODULE_ERR;
+  }
+
+  if (index < 0 || MCount(obj_ptr) <= (size_t)index) {
+    return RedisModule_ReplyWithError(ctx, "index exceeds size");
+  }
+  if (MPageInRange(ctx, obj_ptr, index * obj_ptr->value_size, obj_ptr->value_size,
+                   argv, argc, VGet_RedisCommand)) {
+    return REDISMODULE_OK;
+  }
+  return obj_ptr->ops->reply(ctx, MElement(obj_ptr, index), obj_ptr->value_size);
+}
+
+// VMGET key index [index ...]
+int VMGet_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
+{
+  RedisModule_AutoMemory(ctx); /* Use automatic memory management. */
+  if (argc < 3) return RedisModule_WrongArity(ctx);
+
+  RedisModuleKey *key =
+      RedisModule_OpenKey(ctx, argv[1], REDISMODULE_READ | REDISMODULE_WRITE);
+  int type = RedisModule_KeyType(key);
+  if (type != REDISMODULE_KEYTYPE_EMPTY &&
+      RedisModule_ModuleTypeGetType(key) != MMapType) {
+    return RedisModule_ReplyWithError(ctx, REDISMODULE_ERRORMSG_WRONGTYPE);
+  }
+
+  if (type == REDISMODULE_KEYTYPE_EMPTY) {
+    return RedisModule_ReplyWithError(ctx, "You must do MMAP first");
+  }
+
+  MMapObject *obj_ptr = RedisModule_ModuleTypeGetValue(key);
+  if (obj_ptr == NULL) {
+    return REDISMODULE_ERR;
+  }
+
+  size_t count = MCount(obj_ptr);
+  uint64_t *indices = zmalloc(sizeof(uint64_t) * (argc - 2));
+  for (int i = 2; i < argc; ++i) {
+    long long index;
+    if (RedisModule_StringToLongLong(argv[i], &index) == REDISMODULE_ERR) {
+      zfree(indices);
+      return RedisModule_ReplyWithError(ctx, "index argument must be integer");
+    }
+    if (index < 0 || count <= (size_t)index) {
+      zfree(indices);
+      return RedisModule_ReplyWithError(ctx, "index exceeds size");
+    }
+    indices[i - 2] = (uint64_t)index;
+  }
+
+  size_t n = argc - 2;
+  // large batches are gathered on the worker threads, which take the page faults as well
+  if ((long long)n >= MGatherThreshold && !MPageInReplay && MCanBlock(ctx)) {
+    MJobStartGather(ctx, argv[1], obj_ptr, "VMGET", indices, 0, 1, n);
+    return REDISMODULE_OK;
+  }
+  if (MPageInIndices(ctx, obj_ptr, indices, n, argv, argc, VMGet_RedisCommand)) {
+    zfree(indices);
+    return REDISMODULE_OK;
+  }
+  uint8_t value_size = obj_ptr->value_size;
+  char *values = zmalloc(n * value_size + 1);
+  MGather(obj_ptr->file->mmap, MCount(obj_ptr), value_size, indices, n, values, false);
+  zfree(indices);
+
+  RedisModule_ReplyWithArray(ctx, n);
+  for (size_t i = 0; i < n; ++i) {
+    obj_ptr->ops->reply(ctx, values + i * value_size, value_size);
+  }
+  zfree(values);
+  return REDISMODULE_OK;
+}
+
+// VMGETRAW key indices [uint32|uint64] [bitmap]
+int VMGetRaw_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
+{
+  RedisModule_AutoMemory(ctx); /* Use automatic memory management. */
+  if (argc < 3 || 5 < argc) return RedisModule_WrongArity(ctx);
+
+  size_t index_size = sizeof(uint64_t);
+  bool bitmap = false;
+  for (int i = 3; i < argc; ++i) {
+    if (mstringcmp(argv[i], "uint32") == 0) index_size = sizeof(uint32_t);
+    else if (mstringcmp(argv[i], "uint64") == 0) index_size = sizeof(uint64_t);
+    else if (mstringcmp(argv[i], "bitmap") == 0) bitmap = true;
+    else {
+      return RedisModule_ReplyWithError(
+          ctx, "Arguments must be \"uint32\", \"uint64\" or \"bitmap\"");
+    }
+  }
+
+  RedisModuleKey *key =
+      RedisModule_OpenKey(ctx, argv[1], REDISMODULE_READ | REDISMODULE_WRITE);
+  int type = RedisModule_KeyType(key);
+  if (type != REDISMODULE_KEYTYPE_EMPTY &&
+      RedisModule_ModuleTypeGetType(key) != MMapType) {
+    return RedisModule_ReplyWithError(ctx, REDISMODULE_ERRORMSG_WRONGTYPE);
+  }
+
+  if (type == REDISMODULE_KEYTYPE_EMPTY) {
+    return RedisModule_ReplyWithError(ctx, "You must do MMAP first");
+  }
+
+  MMapObject *obj_ptr = RedisModule_ModuleTypeGetValue(key);
+  if (obj_ptr == NULL) {
+    return REDISMODULE_ERR;
+  }
+
+  size_t indices_len;
+  const char *indices = RedisModule_StringPtrLen(argv[2], &indices_len);
+  if (indices_len % index_size != 0) {
+    return RedisModule_ReplyWithError(ctx, "length of indices must be a multiple of index size");
+  }
+  size_t n = indices_len / index_size;
+  size_t count = MCount(obj_ptr);
+  uint8_t value_size = obj_ptr->value_size;
+
+  // out of range values are zero filled and cleared in the bitmap, if it is requested
+  uint64_t *index_list = zmalloc(sizeof(uint64_t) * n + 1);
+  uint8_t *valid = bitmap ? zcalloc((n + 7) / 8 + 1) : NULL;
+  for (size_t i = 0; i < n; ++i) {
+    uint64_t index = index_size == sizeof(uint64_t) ? MLoadIndex64(indices + i * index_size)
+                                                    : MLoadIndex32(indices + i * index_size);
+    if (count <= index) {
+      if (!bitmap) {
+        zfree(index_list);
+        return RedisModule_ReplyWithError(ctx, "index exceeds size");
+      }
+    }
+    else if (bitmap) valid[i / 8] |= 1 << (i % 8);
+    index_list[i] = index;
+  }
+  if (MPageInIndices(ctx, obj_ptr, index_list, n, argv, argc, VMGetRaw_RedisCommand)) {
+    zfree(index_list);
+    zfree(valid);
+    return REDISMODULE_OK;
+  }
+  char *values = zcalloc(n * value_size + 1);
+  MGather(obj_ptr->file->mmap, count, value_size, index_list, n, values, false);
+  zfree(index_list);
+
+  if (bitmap) {
+    RedisModule_ReplyWithArray(ctx, 2);
+    RedisModule_ReplyWithStringBuffer(ctx, values, n * value_size);
+    RedisModule_ReplyWithStringBuffer(ctx, (char *)valid, (n + 7) / 8);
+    zfree(valid);
+  }
+  else RedisModule_ReplyWithStringBuffer(ctx, values, n * value_size);
+  zfree(values);
+  return REDISMODULE_OK;
+}
+
+// VALL key
+int VAll_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
+{
+  RedisModule_AutoMemory(ctx); /* Use automatic memory management. */
+  if (argc != 2) return RedisModule_WrongArity(ctx);
+
+  RedisModuleKey *key =
+      RedisModule_OpenKey(ctx, argv[1], REDISMODULE_READ | REDISMODULE_WRITE);
+  int type = RedisModule_KeyType(key);
+  if (type != REDISMODULE_KEYTYPE_EMPTY &&
+      RedisModule_ModuleTypeGetType(key) != MMapType) {
+    return RedisModule_ReplyWithError(ctx, REDISMODULE_ERRORMSG_WRONGTYPE);
+  }
+
+  if (type == REDISMODULE_KEYTYPE_EMPTY) {
+    return RedisModule_ReplyWithError(ctx, "You must do MMAP first");
+  }
+
+  MMapObject *obj_ptr = RedisModule_ModuleTypeGetValue(key);
+  if (obj_ptr == NULL) {
+    return REDISMODULE_ERR;
+  }
+
+  size_t count = MCount(obj_ptr);
+  if (MPageInRange(ctx, obj_ptr, 0, obj_ptr->file->file_size, argv, argc, VAll_RedisCommand)) {
+    return REDISMODULE_OK;
+  }
+  RedisModule_ReplyWithArray(ctx, count);
+  for (size_t index = 0; index < count; ++index) {
+    obj_ptr->ops->reply(ctx, MElement(obj_ptr, index), obj_ptr->value_size);
+  }
+  return REDISMODULE_OK;
+}
+
+// VRANGE key start stop [step n]
+int VRange_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
+{
+  RedisModule_AutoMemory(ctx); /* Use automatic memory management. */
+  if (argc != 4 && argc != 6) return RedisModule_WrongArity(ctx);
+
+  long long start, stop, step = 1;
+  if (RedisModule_StringToLongLong(argv[2], &start) == REDISMODULE_ERR ||
+      RedisModule_StringToLongLong(argv[3], &stop) == REDISMODULE_ERR) {
+    return RedisModule_ReplyWithError(ctx, "start and stop must be integer");
+  }
+  if (argc == 6) {
+    if (mstringcmp(argv[4], "step") != 0) {
+      return RedisModule_ReplyWithError(ctx, "Argument must be \"step\"");
+    }
+    if (RedisModule_StringToLongLong(argv[5], &step) == REDISMODULE_ERR || step <= 0) {
+      return RedisModule_ReplyWithError(ctx, "step must be positive integer");
+    }
+  }
+
+  RedisModuleKey *key =
+      RedisModule_OpenKey(ctx, argv[1], REDISMODULE_READ | REDISMODULE_WRITE);
+  int type = RedisModule_KeyType(key);
+  if (type != REDISMODULE_KEYTYPE_EMPTY &&
+      RedisModule_ModuleTypeGetType(key) != MMapType) {
+    return RedisModule_ReplyWithError(ctx, REDISMODULE_ERRORMSG_WRONGTYPE);
+  }
+
+  if (type == REDISMODULE_KEYTYPE_EMPTY) {
+    return RedisModule_ReplyWithError(ctx, "You must do MMAP first");
+  }
+
+  MMapObject *obj_ptr = RedisModule_ModuleTypeGetValue(key);
+  if (obj_ptr == NULL) {
+    return REDISMODULE_ERR;
+  }
+
+  // same as LRANGE: negative indices count from the end, stop is inclusive
+  long long count = (long long)MCount(obj_ptr);
+  if (start < 0) start += count;
+  if (stop < 0) stop += count;
+  if (start < 0) start = 0;
+  if (count <= stop) stop = count - 1;
+  if (stop < start) return RedisModule_ReplyWithEmptyArray(ctx);
+  size_t n = (stop - start) / step + 1;
+  if ((long long)n >= MGatherThreshold && !MPageInReplay && MCanBlock(ctx)) {
+    MJobStartGather(ctx, argv[1], obj_ptr, "VRANGE", NULL, start, step, n);
+    return REDISMODULE_OK;
+  }
+  if (MPageInRange(ctx, obj_ptr, start * obj_ptr->value_size,
+                   (stop - start + 1) * obj_ptr->value_size, argv, argc, VRange_RedisCommand)) {
+    return REDISMODULE_OK;
+  }
+
+  RedisModule_ReplyWithArray(ctx, n);
+  for (long long index = start; index <= stop; index += step) {
+    obj_ptr->ops->reply(ctx, MElement(obj_ptr, index), obj_ptr->value_size);
+  }
+  return REDISMODULE_OK;
+}
+
+// VSCAN key cursor [count n]
+int VScan_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
+{
+  RedisModule_AutoMemory(ctx); /* Use automatic memory management. */
+  if (argc != 3 && argc != 5) return RedisModule_WrongArity(ctx);
+
+  long long cursor, scan_count = 10;
+  if (RedisModule_StringToLongLong(argv[2], &cursor) == REDISMODULE_ERR || cursor < 0) {
+    return RedisModule_ReplyWithError(ctx, "invalid cursor");
+  }
+  if (argc == 5) {
+    if (mstringcmp(argv[3], "count") != 0) {
+      return RedisModule_ReplyWithError(ctx, "Argument must be \"count\"");
+    }
+    if (RedisModule_StringToLongLong(argv[4], &scan_count) == REDISMODULE_ERR || scan_count <= 0) {
+      return RedisModule_ReplyWithError(ctx, "count must be positive integer");
+    }
+  }
+
+  RedisModuleKey *key =
+      RedisModule_OpenKey(ctx, argv[1], REDISMODULE_READ | REDISMODULE_WRITE);
+  int type = RedisModule_KeyType(key);
+  if (type != REDISMODULE_KEYTYPE_EMPTY &&
+      RedisModule_ModuleTypeGetType(key) != MMapType) {
+    return RedisModule_ReplyWithError(ctx, REDISMODULE_ERRORMSG_WRONGTYPE);
+  }
+
+  if (type == REDISMODULE_KEYTYPE_EMPTY) {
+    return RedisModule_ReplyWithError(ctx, "You must do MMAP first");
+  }
+
+  MMapObject *obj_ptr = RedisModule_ModuleTypeGetValue(key);
+  if (obj_ptr == NULL) {
+    return REDISMODULE_ERR;
+  }
+
+  // the cursor is the next index, and 0 means the scan is complete
+  size_t count = MCount(obj_ptr);
+  size_t start = (size_t)cursor < count ? (size_t)cursor : count;
+  size_t stop = count - start < (size_t)scan_count ? count : start + scan_count;
+  size_t next = stop < count ? stop : 0;
+  if (MPageInRange(ctx, obj_ptr, start * obj_ptr->value_size,
+                   (stop - start) * obj_ptr->value_size, argv, argc, VScan_RedisCommand)) {
+    return REDISMODULE_OK;
+  }
+
+  char buffer[32];
+  RedisModule_ReplyWithArray(ctx, 2);
+  RedisModule_ReplyWithStringBuffer(ctx, buffer, snprintf(buffer, sizeof(buffer), "%zu", next));
+  RedisModule_ReplyWithArray(ctx, stop - start);
+  for (size_t index = start; index < stop; ++index) {
+    obj_ptr->ops->reply(ctx, MElement(obj_ptr, index), obj_ptr->value_size);
+  }
+  return REDISMODULE_OK;
+}
+
+// VGETRAW key start count
+int VGetRaw_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
+{
+  RedisModule_AutoMemory(ctx); /* Use automatic memory management. */
+  if (argc != 4) return RedisModule_WrongArity(ctx);
+
+  long long start, get_count;
+  if (RedisModule_StringToLongLong(argv[2], &start) == REDISMODULE_ERR) {
+    return RedisModule_ReplyWithError(ctx, "index argument must be integer");
+  }
+  if (RedisModule_StringToLongLong(argv[3], &get_count) == REDISMODULE_ERR || get_count < 0) {
+    return RedisModule_ReplyWithError(ctx, "count must be non-negative integer");
+  }
+
+  RedisModuleKey *key =
+      RedisModule_OpenKey(ctx, argv[1], REDISMODULE_READ | REDISMODULE_WRITE);
+  int type = RedisModule_KeyType(key);
+  if (type != REDISMODULE_KEYTYPE_EMPTY &&
+      RedisModule_ModuleTypeGetType(key) != MMapType) {
+    return RedisModule_ReplyWithError(ctx, REDISMODULE_ERRORMSG_WRONGTYPE);
+  }
+
+  if (type == REDISMODULE_KEYTYPE_EMPTY) {
+    return RedisModule_ReplyWithError(ctx, "You must do MMAP first");
+  }
+
+  MMapObject *obj_ptr = RedisModule_ModuleTypeGetValue(key);
+  if (obj_ptr == NULL) {
+    return REDISMODULE_ERR;
+  }
+
+  size_t count = MCount(obj_ptr);
+  if (start < 0 || count < (size_t)start) {
+    return RedisModule_ReplyWithError(ctx, "index exceeds size");
+  }
+  // the slice is cut at the end of the values
+  if (count - start < (size_t)get_count) get_count = count - start;
+  if (get_count == 0) return RedisModule_ReplyWithEmptyString(ctx);
+  if (MPageInRange(ctx, obj_ptr, start * obj_ptr->value_size, get_count * obj_ptr->value_size,
+                   argv, argc, VGetRaw_RedisCommand)) {
+    return REDISMODULE_OK;
+  }
+  return RedisModule_ReplyWithStringBuffer(ctx, MElement(obj_ptr, start),
+                                           get_count * obj_ptr->value_size);
+}
+
+// VSET key index value [index value ...] [sync]
+int VSet_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
+{
+  RedisModule_AutoMemory(ctx); /* Use automatic memory management. */
+
+  bool sync = argc % 2 == 1 && mstringcmp(argv[argc - 1], "sync") == 0;
+  if (sync) --argc;
+  if (argc < 4) return RedisModule_WrongArity(ctx);
+  if ((argc - 2) % 2 != 0) return RedisModule_WrongArity(ctx);
+
+  RedisModuleKey *key =
+      RedisModule_OpenKey(ctx, argv[1], REDISMODULE_READ | REDISMODULE_WRITE);
+  int type = RedisModule_KeyType(key);
+  if (type != REDISMODULE_KEYTYPE_EMPTY &&
+      RedisModule_ModuleTypeGetType(key) != MMapType) {
+    return RedisModule_ReplyWithError(ctx, REDISMODULE_ERRORMSG_WRONGTYPE);
+  }
+  if (type == REDISMODULE_KEYTYPE_EMPTY) {
+    return RedisModule_ReplyWithError(ctx, "You must do MMAP first");
+  }
+
+  MMapObject *obj_ptr = RedisModule_ModuleTypeGetValue(key);
+  if (obj_ptr == NULL) {
+    RedisModule_ReplyWithNull(ctx);
+    return REDISMODULE_ERR;
+  }
+  if (!obj_ptr->writable) {
+    return RedisModule_ReplyWithError(ctx, "The file is not writable");
+  }
+
+  size_t count = MCount(obj_ptr);
+  size_t pairs = (argc - 2) / 2;
+
+  // parse writes nothing on error, so a single pair is parsed in place
+  if (pairs == 1) {
+    long long index;
+    if (RedisModule_StringToLongLong(argv[2], &index) == REDISMODULE_ERR) {
+      return RedisModule_ReplyWithError(ctx, "index argument must be integer");
+    }
+    if (index < 0 || count <= (size_t)index) {
+      return RedisModule_ReplyWithError(ctx, "index exceeds size");
+    }
+    const char *err = obj_ptr->ops->parse(argv[3], MElement(obj_ptr, index), obj_ptr->value_size);
+    if (err != NULL) return RedisModule_ReplyWithError(ctx, err);
+    MMarkDirty(ctx, obj_ptr, index * obj_ptr->value_size, obj_ptr->value_size, sync);
+    RedisModule_Replicate(ctx, "VSETRAW", "slb", argv[1], index, MElement(obj_ptr, index),
+                          (size_t)obj_ptr->value_size);
+    if (sync) return MReplySynced(ctx, obj_ptr, 1);
+    return RedisModule_ReplyWithLongLong(ctx, 1);
+  }
+
+  // parse all pairs first so that nothing is written on error
+  uint64_t *indices = zmalloc(sizeof(uint64_t) * pairs);
+  char *values = zmalloc(obj_ptr->value_size * pairs);
+  for (size_t i = 0; i < pairs; ++i) {
+    long long index;
+    if (RedisModule_StringToLongLong(argv[2 + i * 2], &index) == REDISMODULE_ERR) {
+      zfree(indices);
+      zfree(values);
+      return RedisModule_ReplyWithError(ctx, "index argument must be integer");
+    }
+    if (index < 0 || count <= (size_t)index) {
+      zfree(indices);
+      zfree(values);
+      return RedisModule_ReplyWithError(ctx, "index exceeds size");
+    }
+    indices[i] = (uint64_t)index;
+    const char *err = obj_ptr->ops->parse(argv[3 + i * 2],
+                                          values + i * obj_ptr->value_size,
+                                          obj_ptr->value_size);
+    if (err != NULL) {
+      zfree(indices);
+      zfree(values);
+      return RedisModule_ReplyWithError(ctx, err);
+    }
+  }
+  size_t min_index = count, max_index = 0;
+  for (size_t i = 0; i < pairs; ++i) {
+    memcpy(MElement(obj_ptr, indices[i]), values + i * obj_ptr->value_size, obj_ptr->value_size);
+    MMarkBlocks(obj_ptr->file, indices[i] * obj_ptr->value_size, obj_ptr->value_size);
+    if (indices[i] < min_index) min_index = indices[i];
+    if (max_index < indices[i]) max_index = indices[i];
+  }
+  MMarkFlush(ctx, obj_ptr, min_index * obj_ptr->value_size,
+             (max_index - min_index + 1) * obj_ptr->value_size, sync);
+  // the values are propagated packed, as they are in the file
+  RedisModule_Replicate(ctx, "VMSETRAW", "sbb", argv[1], (const char *)indices, sizeof(uint64_t) * pairs,
+                        values, obj_ptr->value_size * pairs);
+  zfree(indices);
+  zfree(values);
+  if (sync) return MReplySynced(ctx, obj_ptr, pairs);
+  return RedisModule_ReplyWithLongLong(ctx, pairs);
+}
+
+
+// VSETRAW key index values
+int VSetRaw_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
+{
+  RedisModule_AutoMemory(ctx); /* Use automatic memory management. */
+
+  if (argc != 4) return RedisModule_WrongArity(ctx);
+
+  long long index;
+  if (RedisModule_StringToLongLong(argv[2], &index) == REDISMODULE_ERR) {
+    return RedisModule_ReplyWithError(ctx, "index argument must be integer");
+  }
+
+  RedisModuleKey *key =
+      RedisModule_OpenKey(ctx, argv[1], REDISMODULE_READ | REDISMODULE_WRITE);
+  int type = RedisModule_KeyType(key);
+  if (type != REDISMODULE_KEYTYPE_EMPTY &&
+      RedisModule_ModuleTypeGetType(key) != MMapType) {
+    return RedisModule_ReplyWithError(ctx, REDISMODULE_ERRORMSG_WRONGTYPE);
+  }
+  if (type == REDISMODULE_KEYTYPE_EMPTY) {
+    return RedisModule_ReplyWithError(ctx, "You must do MMAP first");
+  }
+
+  MMapObject *obj_ptr = RedisModule_ModuleTypeGetValue(key);
+  if (obj_ptr == NULL) {
+    RedisModule_ReplyWithNull(ctx);
+    return REDISMODULE_ERR;
+  }
+  if (!obj_ptr->writable) {
+    return RedisModule_ReplyWithError(ctx, "The file is not writable");
+  }
+
+  size_t len;
+  const char *values = RedisModule_StringPtrLen(argv[3], &len);
+  if (len % obj_ptr->value_size != 0) {
+    return RedisModule_ReplyWithError(ctx, "length of values must be a multiple of value_size");
+  }
+  size_t n = len / obj_ptr->value_size;
+  if (index < 0 || MCount(obj_ptr) - n < (size_t)index || MCount(obj_ptr) < n) {
+    return RedisModule_ReplyWithError(ctx, "index exceeds size");
+  }
+  memcpy(MElement(obj_ptr, index), values, len);
+  MMarkDirty(ctx, obj_ptr, index * obj_ptr->value_size, len, false);
+  MReplicateCommand(ctx, argv, argc);
+  return RedisModule_ReplyWithLongLong(ctx, n);
+}
+
+// VMSETRAW key indices values
+int VMSetRaw_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
+{
+  RedisModule_AutoMemory(ctx); /* Use automatic memory management. */
+
+  if (argc != 4) return RedisModule_WrongArity(ctx);
+
+  RedisModuleKey *key =
+      RedisModule_OpenKey(ctx, argv[1], REDISMODULE_READ | REDISMODULE_WRITE);
+  int type = RedisModule_KeyType(key);
+  if (type != REDISMODULE_KEYTYPE_EMPTY &&
+      RedisModule_ModuleTypeGetType(key) != MMapType) {
+    return RedisModule_ReplyWithError(ctx, REDISMODULE_ERRORMSG_WRONGTYPE);
+  }
+  if (type == REDISMODULE_KEYTYPE_EMPTY) {
+    return RedisModule_ReplyWithError(ctx, "You must do MMAP first");
+  }
+
+  MMapObject *obj_ptr = RedisModule_ModuleTypeGetValue(key);
+  if (obj_ptr == NULL) {
+    RedisModule_ReplyWithNull(ctx);
+    return REDISMODULE_ERR;
+  }
+  if (!obj_ptr->writable) {
+    return RedisModule_ReplyWithError(ctx, "The file is not writable");
+  }
+
+  size_t indices_len, values_len;
+  const char *indices = RedisModule_StringPtrLen(argv[2], &indices_len);
+  const char *values = RedisModule_StringPtrLen(argv[3], &values_len);
+  if (indices_len % sizeof(uint64_t) != 0) {
+    return RedisModule_ReplyWithError(ctx, "length of indices must be a multiple of 8");
+  }
+  size_t n = indices_len / sizeof(uint64_t);
+  if (values_len != n * obj_ptr->value_size) {
+    return RedisModule_ReplyWithError(ctx, "length of values must be number of indices * value_size");
+  }
+
+  // check all indices in one pass before anything is written
+  uint64_t min_index = UINT64_MAX, max_index = 0;
+  for (size_t i = 0; i < n; ++i) {
+    uint64_t index = MLoadIndex64(indices + i * sizeof(uint64_t));
+    min_index = index < min_index ? index : min_index;
+    max_index = max_index < index ? index : max_index;
+  }
+  if (0 < n && MCount(obj_ptr) <= max_index) {
+    return RedisModule_ReplyWithError(ctx, "index exceeds size");
+  }
+  for (size_t i = 0; i < n; ++i) {
+    uint64_t index = MLoadIndex64(indices + i * sizeof(uint64_t));
+    memcpy(MElement(obj_ptr, index), values + i * obj_ptr->value_size, obj_ptr->value_size);
+    MMarkBlocks(obj_ptr->file, index * obj_ptr->value_size, obj_ptr->value_size);
+  }
+  if (0 < n) {
+    MMarkFlush(ctx, obj_ptr, min_index * obj_ptr->value_size,
+               (max_index - min_index + 1) * obj_ptr->value_size, false);
+    MReplicateCommand(ctx, argv, argc);
+  }
+  return RedisModule_ReplyWithLongLong(ctx, n);
+}
+
+// VADD key value [value ...] [sync]
+int VAdd_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
+{
+  RedisModule_AutoMemory(ctx); /* Use automatic memory management. */
+
+  if (argc < 3) return RedisModule_WrongArity(ctx);
+
+  RedisModuleKey *key =
+      RedisModule_OpenKey(ctx, argv[1], REDISMODULE_READ | REDISMODULE_WRITE);
+  int type = RedisModule_KeyType(key);
+  if (type != REDISMODULE_KEYTYPE_EMPTY &&
+      RedisModule_ModuleTypeGetType(key) != MMapType) {
+    return RedisModule_ReplyWithError(ctx, REDISMODULE_ERRORMSG_WRONGTYPE);
+  }
+  if (type == REDISMODULE_KEYTYPE_EMPTY) {
+    return RedisModule_ReplyWithError(ctx, "You must do MMAP first");
+  }
+
+  MMapObject *obj_ptr = RedisModule_ModuleTypeGetValue(key);
+  if (obj_ptr == NULL) {
+    RedisModule_ReplyWithNull(ctx);
+    return REDISMODULE_ERR;
+  }
+  if (!obj_ptr->writable) {
+    return RedisModule_ReplyWithError(ctx, "The file is not writable");
   }
 
-  return RedisModule_ReplyWithLongLong(ctx, obj_ptr->file_size / obj_ptr->value_size);
+  // "sync" is a valid string value, so a string key takes it as a value
+  bool sync = argc > 3 && obj_ptr->value_type != MTYPE_STRING && mstringcmp(argv[argc - 1], "sync") == 0;
+  if (sync) --argc;
+
+  size_t n = argc - 2;
+  size_t new_size = obj_ptr->file->file_size + obj_ptr->value_size * n;
+  if (MReserve(obj_ptr, new_size) == -1) {
+    return RedisModule_ReplyWithError(ctx, "Can't extend the file");
+  }
+  // values are stored past the logical end and committed only when all of them are valid
+  for (size_t i = 0; i < n; ++i) {
+    const char *err = obj_ptr->ops->parse(argv[2 + i],
+                                          (char *)obj_ptr->file->mmap + obj_ptr->file->file_size + i * obj_ptr->value_size,
+                                          obj_ptr->value_size);
+    if (err != NULL) return RedisModule_ReplyWithError(ctx, err);
+  }
+  MSetFileSize(obj_ptr, new_size);
+  MMarkDirty(ctx, obj_ptr, new_size - obj_ptr->value_size * n, obj_ptr->value_size * n, sync);
+  MReplicateAppend(ctx, argv[1], new_size / obj_ptr->value_size - n,
+                   (char *)obj_ptr->file->mmap + new_size - obj_ptr->value_size * n, obj_ptr->value_size * n);
+  if (sync) return MReplySynced(ctx, obj_ptr, n);
+  return RedisModule_ReplyWithLongLong(ctx, n);
 }
 
-// VGET key index
-int VGet_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
+// VADDRAW key values [sync]
+int VAddRaw_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
 {
   RedisModule_AutoMemory(ctx); /* Use automatic memory management. */
-  if (argc != 3) return RedisModule_WrongArity(ctx);
+
+  if (argc != 3 && argc != 4) return RedisModule_WrongArity(ctx);
+  bool sync = false;
+  if (argc == 4) {
+    if (mstringcmp(argv[3], "sync") != 0) {
+      return RedisModule_ReplyWithError(ctx, "Argument must be \"sync\"");
+    }
+    sync = true;
+  }
 
   RedisModuleKey *key =
       RedisModule_OpenKey(ctx, argv[1], REDISMODULE_READ | REDISMODULE_WRITE);
@@ -240,74 +3089,47 @@ int VGet_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
       RedisModule_ModuleTypeGetType(key) != MMapType) {
     return RedisModule_ReplyWithError(ctx, REDISMODULE_ERRORMSG_WRONGTYPE);
   }
-
   if (type == REDISMODULE_KEYTYPE_EMPTY) {
     return RedisModule_ReplyWithError(ctx, "You must do MMAP first");
   }
 
-  long long index;
-  if (RedisModule_StringToLongLong(argv[2], &index) == REDISMODULE_ERR) {
-    return RedisModule_ReplyWithError(ctx, "index argument must be integer");
-  }
-
   MMapObject *obj_ptr = RedisModule_ModuleTypeGetValue(key);
   if (obj_ptr == NULL) {
+    RedisModule_ReplyWithNull(ctx);
     return REDISMODULE_ERR;
   }
+  if (!obj_ptr->writable) {
+    return RedisModule_ReplyWithError(ctx, "The file is not writable");
+  }
 
-  if (obj_ptr->file_size <= (size_t)index * obj_ptr->value_size || index < 0) {
-    return RedisModule_ReplyWithError(ctx, "index exceeds size");
+  size_t len;
+  const char *values = RedisModule_StringPtrLen(argv[2], &len);
+  if (len % obj_ptr->value_size != 0) {
+    return RedisModule_ReplyWithError(ctx, "length of values must be a multiple of value_size");
   }
-  else {
-    if (strcasecmp(obj_ptr->value_type, "int8") == 0) {
-      RedisModule_ReplyWithLongLong(ctx, ((int8_t*)obj_ptr->mmap)[index]);
-    }
-    else if (strcasecmp(obj_ptr->value_type, "uint8") == 0) {
-      RedisModule_ReplyWithLongLong(ctx, ((uint8_t*)obj_ptr->mmap)[index]);
-    }
-    else if (strcasecmp(obj_ptr->value_type, "int16") == 0) {
-      RedisModule_ReplyWithLongLong(ctx, ((int16_t*)obj_ptr->mmap)[index]);
-    }
-    else if (strcasecmp(obj_ptr->value_type, "uint16") == 0) {
-      RedisModule_ReplyWithLongLong(ctx, ((uint16_t*)obj_ptr->mmap)[index]);
-    }
-    else if (strcasecmp(obj_ptr->value_type, "int32") == 0) {
-      RedisModule_ReplyWithLongLong(ctx, ((int32_t*)obj_ptr->mmap)[index]);
-    }
-    else if (strcasecmp(obj_ptr->value_type, "uint32") == 0) {
-      RedisModule_ReplyWithLongLong(ctx, ((uint32_t*)obj_ptr->mmap)[index]);
-    }
-    else if (strcasecmp(obj_ptr->value_type, "int64") == 0) {
-      RedisModule_ReplyWithLongLong(ctx, ((int64_t*)obj_ptr->mmap)[index]);
-    }
-    else if (strcasecmp(obj_ptr->value_type, "uint64") == 0) {
-      RedisModule_ReplyWithLongLong(ctx, ((uint64_t*)obj_ptr->mmap)[index]);
-    }
-    else if (strcasecmp(obj_ptr->value_type, "float") == 0) {
-      RedisModule_ReplyWithDouble(ctx, ((float*)obj_ptr->mmap)[index]);
-    }
-    else if (strcasecmp(obj_ptr->value_type, "double") == 0) {
-      RedisModule_ReplyWithDouble(ctx, ((double*)obj_ptr->mmap)[index]);
-    }
-    else if (strcasecmp(obj_ptr->value_type, "long_double") == 0) {
-      RedisModule_ReplyWithLongDouble(ctx, ((long double*)obj_ptr->mmap)[index]);
-    }
-    else if (strcasecmp(obj_ptr->value_type, "string") == 0) {
-      char *buffer = zcalloc(obj_ptr->value_size + 1);
-      snprintf(buffer, obj_ptr->value_size + 1, "%s", (char *)obj_ptr->mmap + index * obj_ptr->value_size);
-      RedisModule_ReplyWithStringBuffer(ctx, buffer, strlen(buffer));
-      zfree(buffer);
-    }
-    else return REDISMODULE_ERR;
+  size_t new_size = obj_ptr->file->file_size + len;
+  if (MReserve(obj_ptr, new_size) == -1) {
+    return RedisModule_ReplyWithError(ctx, "Can't extend the file");
   }
-  return REDISMODULE_OK;
+  memcpy((char *)obj_ptr->file->mmap + obj_ptr->file->file_size, values, len);
+  MSetFileSize(obj_ptr, new_size);
+  MMarkDirty(ctx, obj_ptr, new_size - len, len, sync);
+  MReplicateAppend(ctx, argv[1], (new_size - len) / obj_ptr->value_size, values, len);
+  if (sync) return MReplySynced(ctx, obj_ptr, len / obj_ptr->value_size);
+  return RedisModule_ReplyWithLongLong(ctx, len / obj_ptr->value_size);
 }
 
-// VMGET key index [index ...]
-int VMGet_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
+// VADDRAWAT key index values
+int VAddRawAt_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
 {
   RedisModule_AutoMemory(ctx); /* Use automatic memory management. */
-  if (argc < 3) return RedisModule_WrongArity(ctx);
+
+  if (argc != 4) return RedisModule_WrongArity(ctx);
+
+  long long index;
+  if (RedisModule_StringToLongLong(argv[2], &index) == REDISMODULE_ERR) {
+    return RedisModule_ReplyWithError(ctx, "index argument must be integer");
+  }
 
   RedisModuleKey *key =
       RedisModule_OpenKey(ctx, argv[1], REDISMODULE_READ | REDISMODULE_WRITE);
@@ -316,169 +3138,84 @@ int VMGet_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
       RedisModule_ModuleTypeGetType(key) != MMapType) {
     return RedisModule_ReplyWithError(ctx, REDISMODULE_ERRORMSG_WRONGTYPE);
   }
-
   if (type == REDISMODULE_KEYTYPE_EMPTY) {
     return RedisModule_ReplyWithError(ctx, "You must do MMAP first");
   }
 
   MMapObject *obj_ptr = RedisModule_ModuleTypeGetValue(key);
   if (obj_ptr == NULL) {
+    RedisModule_ReplyWithNull(ctx);
     return REDISMODULE_ERR;
   }
-
-  long long index;
-  for (int i = 2; i < argc; i += 2) {
-    if (RedisModule_StringToLongLong(argv[i], &index) == REDISMODULE_ERR) {
-      return RedisModule_ReplyWithError(ctx, "index argument must be integer");
-    }
-    if ((long long)obj_ptr->file_size <= index * obj_ptr->value_size || index < 0) {
-      return RedisModule_ReplyWithError(ctx, "index exceeds size");
-    }
+  if (!obj_ptr->writable) {
+    return RedisModule_ReplyWithError(ctx, "The file is not writable");
   }
 
-  RedisModule_ReplyWithArray(ctx, argc - 2);
-  if (strcasecmp(obj_ptr->value_type, "int8") == 0) {
-    for (int i = 2; i < argc; i++) {
-      RedisModule_StringToLongLong(argv[i], &index);
-      if (obj_ptr->file_size <= (size_t)index * obj_ptr->value_size || index < 0) {
-        RedisModule_ReplyWithNull(ctx);
-      }
-      else {
-        RedisModule_ReplyWithLongLong(ctx, ((int8_t*)obj_ptr->mmap)[index]);
-      }
-    }
-  }
-  else if (strcasecmp(obj_ptr->value_type, "uint8") == 0) {
-    for (int i = 2; i < argc; i++) {
-      RedisModule_StringToLongLong(argv[i], &index);
-      if (obj_ptr->file_size <= (size_t)index * obj_ptr->value_size || index < 0) {
-        RedisModule_ReplyWithNull(ctx);
-      }
-      else {
-        RedisModule_ReplyWithLongLong(ctx, ((uint8_t*)obj_ptr->mmap)[index]);
-      }
-    }
-  }
-  else if (strcasecmp(obj_ptr->value_type, "int16") == 0) {
-    for (int i = 2; i < argc; i++) {
-      RedisModule_StringToLongLong(argv[i], &index);
-      if (obj_ptr->file_size <= (size_t)index * obj_ptr->value_size || index < 0) {
-        RedisModule_ReplyWithNull(ctx);
-      }
-      else {
-        RedisModule_ReplyWithLongLong(ctx, ((int16_t*)obj_ptr->mmap)[index]);
-      }
-    }
+  size_t len;
+  const char *values = RedisModule_StringPtrLen(argv[3], &len);
+  if (len % obj_ptr->value_size != 0) {
+    return RedisModule_ReplyWithError(ctx, "length of values must be a multiple of value_size");
   }
-  else if (strcasecmp(obj_ptr->value_type, "uint16") == 0) {
-    for (int i = 2; i < argc; i++) {
-      RedisModule_StringToLongLong(argv[i], &index);
-      if (obj_ptr->file_size <= (size_t)index * obj_ptr->value_size || index < 0) {
-        RedisModule_ReplyWithNull(ctx);
-      }
-      else {
-        RedisModule_ReplyWithLongLong(ctx, ((uint16_t*)obj_ptr->mmap)[index]);
-      }
-    }
+  if (index < 0 || MCount(obj_ptr) < (size_t)index) {
+    return RedisModule_ReplyWithError(ctx, "index exceeds size");
   }
-  else if (strcasecmp(obj_ptr->value_type, "int32") == 0) {
-    for (int i = 2; i < argc; i++) {
-      RedisModule_StringToLongLong(argv[i], &index);
-      if (obj_ptr->file_size <= (size_t)index * obj_ptr->value_size || index < 0) {
-        RedisModule_ReplyWithNull(ctx);
-      }
-      else {
-        RedisModule_ReplyWithLongLong(ctx, ((int32_t*)obj_ptr->mmap)[index]);
-      }
-    }
+  // the values may be there already when the write is replayed, then the count is kept
+  size_t offset = (size_t)index * obj_ptr->value_size;
+  size_t new_size = obj_ptr->file->file_size < offset + len ? offset + len : obj_ptr->file->file_size;
+  if (MReserve(obj_ptr, new_size) == -1) {
+    return RedisModule_ReplyWithError(ctx, "Can't extend the file");
   }
-  else if (strcasecmp(obj_ptr->value_type, "uint32") == 0) {
-    for (int i = 2; i < argc; i++) {
-      RedisModule_StringToLongLong(argv[i], &index);
-      if (obj_ptr->file_size <= (size_t)index * obj_ptr->value_size || index < 0) {
-        RedisModule_ReplyWithNull(ctx);
-      }
-      else {
-        RedisModule_ReplyWithLongLong(ctx, ((uint32_t*)obj_ptr->mmap)[index]);
-      }
-    }
+  memcpy((char *)obj_ptr->file->mmap + offset, values, len);
+  if (new_size != obj_ptr->file->file_size) MSetFileSize(obj_ptr, new_size);
+  MMarkDirty(ctx, obj_ptr, offset, len, false);
+  MReplicateCommand(ctx, argv, argc);
+  return RedisModule_ReplyWithLongLong(ctx, len / obj_ptr->value_size);
+}
+
+// VRESERVE key count
+int VReserve_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
+{
+  RedisModule_AutoMemory(ctx); /* Use automatic memory management. */
+  if (argc != 3) return RedisModule_WrongArity(ctx);
+
+  RedisModuleKey *key =
+      RedisModule_OpenKey(ctx, argv[1], REDISMODULE_READ | REDISMODULE_WRITE);
+  int type = RedisModule_KeyType(key);
+  if (type != REDISMODULE_KEYTYPE_EMPTY &&
+      RedisModule_ModuleTypeGetType(key) != MMapType) {
+    return RedisModule_ReplyWithError(ctx, REDISMODULE_ERRORMSG_WRONGTYPE);
   }
-  else if (strcasecmp(obj_ptr->value_type, "int64") == 0) {
-    for (int i = 2; i < argc; i++) {
-      RedisModule_StringToLongLong(argv[i], &index);
-      if (obj_ptr->file_size <= (size_t)index * obj_ptr->value_size || index < 0) {
-        RedisModule_ReplyWithNull(ctx);
-      }
-      else {
-        RedisModule_ReplyWithLongLong(ctx, ((int64_t*)obj_ptr->mmap)[index]);
-      }
-    }
+  if (type == REDISMODULE_KEYTYPE_EMPTY) {
+    return RedisModule_ReplyWithError(ctx, "You must do MMAP first");
   }
-  else if (strcasecmp(obj_ptr->value_type, "uint64") == 0) {
-    for (int i = 2; i < argc; i++) {
-      RedisModule_StringToLongLong(argv[i], &index);
-      if (obj_ptr->file_size <= (size_t)index * obj_ptr->value_size || index < 0) {
-        RedisModule_ReplyWithNull(ctx);
-      }
-      else {
-        RedisModule_ReplyWithLongLong(ctx, ((uint64_t*)obj_ptr->mmap)[index]);
-      }
-    }
+
+  long long count;
+  if (RedisModule_StringToLongLong(argv[2], &count) == REDISMODULE_ERR || count < 0) {
+    return RedisModule_ReplyWithError(ctx, "count must be non-negative integer");
   }
-  else if (strcasecmp(obj_ptr->value_type, "float") == 0) {
-    for (int i = 2; i < argc; i++) {
-      RedisModule_StringToLongLong(argv[i], &index);
-      if (obj_ptr->file_size <= (size_t)index * obj_ptr->value_size || index < 0) {
-        RedisModule_ReplyWithNull(ctx);
-      }
-      else {
-        RedisModule_ReplyWithDouble(ctx, ((float*)obj_ptr->mmap)[index]);
-      }
-    }
+
+  MMapObject *obj_ptr = RedisModule_ModuleTypeGetValue(key);
+  if (obj_ptr == NULL) {
+    return RedisModule_ReplyWithNull(ctx);
   }
-  else if (strcasecmp(obj_ptr->value_type, "double") == 0) {
-    for (int i = 2; i < argc; i++) {
-      RedisModule_StringToLongLong(argv[i], &index);
-      if (obj_ptr->file_size <= (size_t)index * obj_ptr->value_size || index < 0) {
-        RedisModule_ReplyWithNull(ctx);
-      }
-      else {
-        RedisModule_ReplyWithDouble(ctx, ((double*)obj_ptr->mmap)[index]);
-      }
-    }
+  if (!obj_ptr->writable) {
+    return RedisModule_ReplyWithError(ctx, "The file is not writable");
   }
-  else if (strcasecmp(obj_ptr->value_type, "long_double") == 0) {
-    for (int i = 2; i < argc; i++) {
-      RedisModule_StringToLongLong(argv[i], &index);
-      if (obj_ptr->file_size <= (size_t)index * obj_ptr->value_size || index < 0) {
-        RedisModule_ReplyWithNull(ctx);
-      }
-      else {
-        RedisModule_ReplyWithLongDouble(ctx, ((long double*)obj_ptr->mmap)[index]);
-      }
-    }
+
+  // the file size, header included, must fit in off_t
+  if ((uint64_t)count > (uint64_t)(INT64_MAX - obj_ptr->file->offset) / obj_ptr->value_size) {
+    return RedisModule_ReplyWithError(ctx, "count is too large");
   }
-  else if (strcasecmp(obj_ptr->value_type, "string") == 0) {
-    for (int i = 2; i < argc; i++) {
-      RedisModule_StringToLongLong(argv[i], &index);
-      if (obj_ptr->file_size <= (size_t)index * obj_ptr->value_size || index < 0) {
-        RedisModule_ReplyWithNull(ctx);
-      }
-      else {
-        char *buffer = zcalloc(obj_ptr->value_size + 1);
-        snprintf(buffer, obj_ptr->value_size + 1, "%s", (char *)obj_ptr->mmap + index * obj_ptr->value_size);
-        RedisModule_ReplyWithStringBuffer(ctx, buffer, strlen(buffer));
-        zfree(buffer);
-      }
-    }
+  if (obj_ptr->file->capacity < (size_t)count * obj_ptr->value_size &&
+      MResize(obj_ptr, (size_t)count * obj_ptr->value_size) == -1) {
+    return RedisModule_ReplyWithError(ctx, "Can't extend the file");
   }
-  else return REDISMODULE_ERR;
-
-  return REDISMODULE_OK;
+  MReplicateCommand(ctx, argv, argc);
+  return RedisModule_ReplyWithLongLong(ctx, obj_ptr->file->capacity / obj_ptr->value_size);
 }
 
-// VALL key
-int VAll_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
+// VCOUNT key
+int VCount_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
 {
   RedisModule_AutoMemory(ctx); /* Use automatic memory management. */
   if (argc != 2) return RedisModule_WrongArity(ctx);
@@ -497,86 +3234,24 @@ int VAll_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
 
   MMapObject *obj_ptr = RedisModule_ModuleTypeGetValue(key);
   if (obj_ptr == NULL) {
-    return REDISMODULE_ERR;
-  }
-
-  RedisModule_ReplyWithArray(ctx, obj_ptr->file_size / obj_ptr->value_size);
-
-  if (strcasecmp(obj_ptr->value_type, "int8") == 0) {
-    for (size_t index = 0; index < obj_ptr->file_size / obj_ptr->value_size; ++index) {
-      RedisModule_ReplyWithLongLong(ctx, ((int8_t*)obj_ptr->mmap)[index]);
-    }
-  }
-  else if (strcasecmp(obj_ptr->value_type, "uint8") == 0) {
-    for (size_t index = 0; index < obj_ptr->file_size / obj_ptr->value_size; ++index) {
-      RedisModule_ReplyWithLongLong(ctx, ((uint8_t*)obj_ptr->mmap)[index]);
-    }
-  }
-  else if (strcasecmp(obj_ptr->value_type, "int16") == 0) {
-    for (size_t index = 0; index < obj_ptr->file_size / obj_ptr->value_size; ++index) {
-      RedisModule_ReplyWithLongLong(ctx, ((int16_t*)obj_ptr->mmap)[index]);
-    }
-  }
-  else if (strcasecmp(obj_ptr->value_type, "uint16") == 0) {
-    for (size_t index = 0; index < obj_ptr->file_size / obj_ptr->value_size; ++index) {
-      RedisModule_ReplyWithLongLong(ctx, ((uint16_t*)obj_ptr->mmap)[index]);
-    }
-  }
-  else if (strcasecmp(obj_ptr->value_type, "int32") == 0) {
-    for (size_t index = 0; index < obj_ptr->file_size / obj_ptr->value_size; ++index) {
-      RedisModule_ReplyWithLongLong(ctx, ((int32_t*)obj_ptr->mmap)[index]);
-    }
-  }
-  else if (strcasecmp(obj_ptr->value_type, "uint32") == 0) {
-    for (size_t index = 0; index < obj_ptr->file_size / obj_ptr->value_size; ++index) {
-      RedisModule_ReplyWithLongLong(ctx, ((uint32_t*)obj_ptr->mmap)[index]);
-    }
-  }
-  else if (strcasecmp(obj_ptr->value_type, "int64") == 0) {
-    for (size_t index = 0; index < obj_ptr->file_size / obj_ptr->value_size; ++index) {
-      RedisModule_ReplyWithLongLong(ctx, ((int64_t*)obj_ptr->mmap)[index]);
-    }
-  }
-  else if (strcasecmp(obj_ptr->value_type, "uint64") == 0) {
-    for (size_t index = 0; index < obj_ptr->file_size / obj_ptr->value_size; ++index) {
-      RedisModule_ReplyWithLongLong(ctx, ((uint64_t*)obj_ptr->mmap)[index]);
-    }
-  }
-  else if (strcasecmp(obj_ptr->value_type, "float") == 0) {
-    for (size_t index = 0; index < obj_ptr->file_size / obj_ptr->value_size; ++index) {
-      RedisModule_ReplyWithDouble(ctx, ((float*)obj_ptr->mmap)[index]);
-    }
-  }
-  else if (strcasecmp(obj_ptr->value_type, "double") == 0) {
-    for (size_t index = 0; index < obj_ptr->file_size / obj_ptr->value_size; ++index) {
-      RedisModule_ReplyWithDouble(ctx, ((double*)obj_ptr->mmap)[index]);
-    }
-  }
-  else if (strcasecmp(obj_ptr->value_type, "long_double") == 0) {
-    for (size_t index = 0; index < obj_ptr->file_size / obj_ptr->value_size; ++index) {
-      RedisModule_ReplyWithLongDouble(ctx, ((long double*)obj_ptr->mmap)[index]);
-    }
-  }
-  else if (strcasecmp(obj_ptr->value_type, "string") == 0) {
-    for (size_t index = 0; index < obj_ptr->file_size / obj_ptr->value_size; ++index) {
-      char *buffer = zcalloc(obj_ptr->value_size + 1);
-      snprintf(buffer, obj_ptr->value_size + 1, "%s", (char *)obj_ptr->mmap + index * obj_ptr->value_size);
-      RedisModule_ReplyWithStringBuffer(ctx, buffer, strlen(buffer));
-      zfree(buffer);
-    }
+    return RedisModule_ReplyWithNull(ctx);
   }
-  else return REDISMODULE_ERR;
 
-  return REDISMODULE_OK;
+  return RedisModule_ReplyWithLongLong(ctx, MCount(obj_ptr));
 }
 
-// VSET key index value [index value ...]
-int VSet_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
+// VSUM/VMIN/VMAX/VMEAN/VSTDDEV key [start stop]
+static int MAggregateCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc,
+                             MAggregateKind kind)
 {
   RedisModule_AutoMemory(ctx); /* Use automatic memory management. */
+  if (argc != 2 && argc != 4) return RedisModule_WrongArity(ctx);
 
-  if (argc < 4) return RedisModule_WrongArity(ctx);
-  if ((argc - 2) % 2 != 0) return RedisModule_WrongArity(ctx);
+  long long start = 0, stop = -1;
+  if (argc == 4 && (RedisModule_StringToLongLong(argv[2], &start) == REDISMODULE_ERR ||
+                    RedisModule_StringToLongLong(argv[3], &stop) == REDISMODULE_ERR)) {
+    return RedisModule_ReplyWithError(ctx, "start and stop must be integer");
+  }
 
   RedisModuleKey *key =
       RedisModule_OpenKey(ctx, argv[1], REDISMODULE_READ | REDISMODULE_WRITE);
@@ -585,223 +3260,214 @@ int VSet_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
       RedisModule_ModuleTypeGetType(key) != MMapType) {
     return RedisModule_ReplyWithError(ctx, REDISMODULE_ERRORMSG_WRONGTYPE);
   }
+
   if (type == REDISMODULE_KEYTYPE_EMPTY) {
     return RedisModule_ReplyWithError(ctx, "You must do MMAP first");
   }
 
   MMapObject *obj_ptr = RedisModule_ModuleTypeGetValue(key);
   if (obj_ptr == NULL) {
-    RedisModule_ReplyWithNull(ctx);
     return REDISMODULE_ERR;
   }
-  if (!obj_ptr->writable) {
-    return RedisModule_ReplyWithError(ctx, "The file is not writable");
+  if (obj_ptr->ops->aggregate == NULL) {
+    return RedisModule_ReplyWithError(ctx, "The value type can't be aggregated");
   }
 
-  long long index;
-  for (int i = 2; i < argc; i += 2) {
-    if (RedisModule_StringToLongLong(argv[i], &index) == REDISMODULE_ERR) {
-      return RedisModule_ReplyWithError(ctx, "index argument must be integer");
-    }
-    if ((long long)obj_ptr->file_size <= index * obj_ptr->value_size || index < 0) {
-      return RedisModule_ReplyWithError(ctx, "index exceeds size");
-    }
+  // same as VRANGE: negative indices count from the end, stop is inclusive
+  long long count = (long long)MCount(obj_ptr);
+  if (start < 0) start += count;
+  if (stop < 0) stop += count;
+  if (start < 0) start = 0;
+  if (count <= stop) stop = count - 1;
+  if (stop < start) {
+    if (kind == MAGG_SUM) return MReplyAggregateValue(ctx, obj_ptr, 0);
+    return RedisModule_ReplyWithNull(ctx);
   }
 
-  if (strcasecmp(obj_ptr->value_type, "int8") == 0) {
-    long long value;
-    for (int i = 3; i < argc; i += 2) {
-      if (RedisModule_StringToLongLong(argv[i], &value) == REDISMODULE_ERR) {
-        return RedisModule_ReplyWithError(ctx, "value must be integer");
-      }
-      if (value < INT8_MIN || INT8_MAX < value) {
-        return RedisModule_ReplyWithError(ctx, "value must be between -128 and 127");
-      }
-    }
-    for (int i = 2; i < argc; i += 2) {
-      RedisModule_StringToLongLong(argv[i], &index);
-      RedisModule_StringToLongLong(argv[i + 1], &value);
-      *((int8_t*)obj_ptr->mmap + index) = (int8_t)value;
-    }
+  size_t n = stop - start + 1;
+  // large ranges run on the worker threads, unless the client can't be blocked
+  if ((long long)n >= MJobThreshold && MCanBlock(ctx)) {
+    MJobStartAggregate(ctx, argv[1], obj_ptr, kind, start, n);
+    return REDISMODULE_OK;
   }
-  else if (strcasecmp(obj_ptr->value_type, "uint8") == 0) {
-    long long value;
-    for (int i = 3; i < argc; i += 2) {
-      if (RedisModule_StringToLongLong(argv[i], &value) == REDISMODULE_ERR) {
-        return RedisModule_ReplyWithError(ctx, "value must be integer");
-      }
-      if (value < 0 || UINT8_MAX < value) {
-        return RedisModule_ReplyWithError(ctx, "value must be between -128 and 127");
-      }
-    }
-    for (int i = 2; i < argc; i += 2) {
-      RedisModule_StringToLongLong(argv[i], &index);
-      RedisModule_StringToLongLong(argv[i + 1], &value);
-      *((uint8_t*)obj_ptr->mmap + index) = (uint8_t)value;
-    }
+
+  const void *values = MElement(obj_ptr, start);
+  MAggregate agg = {0, 0, 0, 0};
+  obj_ptr->ops->aggregate(values, n, &agg);
+  long double deviation = 0;
+  if (kind == MAGG_STDDEV) {
+    deviation = obj_ptr->ops->deviation(values, n, (double)(MAggregateSum(obj_ptr, &agg) / n));
   }
-  else if (strcasecmp(obj_ptr->value_type, "int16") == 0) {
-    long long value;
-    for (int i = 3; i < argc; i += 2) {
-      if (RedisModule_StringToLongLong(argv[i], &value) == REDISMODULE_ERR) {
-        return RedisModule_ReplyWithError(ctx, "value must be integer");
-      }
-      if (value < INT16_MIN || INT16_MAX < value) {
-        return RedisModule_ReplyWithError(ctx, "value must be int16");
-      }
-    }
-    for (int i = 2; i < argc; i += 2) {
-      RedisModule_StringToLongLong(argv[i], &index);
-      RedisModule_StringToLongLong(argv[i + 1], &value);
-      *((int16_t*)obj_ptr->mmap + index) = (int16_t)value;
-    }
+  return MReplyAggregate(ctx, obj_ptr, kind, &agg, n, deviation);
+}
+
+// VSUM key [start stop]
+int VSum_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
+{
+  return MAggregateCommand(ctx, argv, argc, MAGG_SUM);
+}
+
+// VMIN key [start stop]
+int VMin_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
+{
+  return MAggregateCommand(ctx, argv, argc, MAGG_MIN);
+}
+
+// VMAX key [start stop]
+int VMax_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
+{
+  return MAggregateCommand(ctx, argv, argc, MAGG_MAX);
+}
+
+// VMEAN key [start stop]
+int VMean_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
+{
+  return MAggregateCommand(ctx, argv, argc, MAGG_MEAN);
+}
+
+// VSTDDEV key [start stop]
+int VStddev_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
+{
+  return MAggregateCommand(ctx, argv, argc, MAGG_STDDEV);
+}
+
+// VJOBS
+int VJobs_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
+{
+  RedisModule_AutoMemory(ctx); /* Use automatic memory management. */
+  if (argc != 1) return RedisModule_WrongArity(ctx);
+
+  pthread_mutex_lock(&MJobLock);
+  long jobs = 0;
+  RedisModule_ReplyWithArray(ctx, REDISMODULE_POSTPONED_ARRAY_LEN);
+  for (MJob *job = MJobs; job != NULL; job = job->next_job) {
+    // VSTDDEV runs the morsels twice
+    size_t passes = !job->gather && job->kind == MAGG_STDDEV ? 2 : 1;
+    size_t morsels = job->total_morsels;
+    size_t done = job->finished ? morsels * passes : (job->pass - 1) * morsels + job->done;
+    RedisModule_ReplyWithArray(ctx, 6);
+    RedisModule_ReplyWithLongLong(ctx, job->id);
+    RedisModule_ReplyWithSimpleString(ctx, job->command);
+    RedisModule_ReplyWithStringBuffer(ctx, job->key_name, sdslen(job->key_name));
+    RedisModule_ReplyWithLongLong(ctx, done);
+    RedisModule_ReplyWithLongLong(ctx, morsels * passes);
+    RedisModule_ReplyWithSimpleString(ctx, job->cancelled ? "cancelled" : job->finished ? "finished" : "running");
+    ++jobs;
   }
-  else if (strcasecmp(obj_ptr->value_type, "uint16") == 0) {
-    long long value;
-    for (int i = 3; i < argc; i += 2) {
-      if (RedisModule_StringToLongLong(argv[i], &value) == REDISMODULE_ERR) {
-        return RedisModule_ReplyWithError(ctx, "value must be integer");
-      }
-      if (value < 0 || UINT16_MAX < value) {
-        return RedisModule_ReplyWithError(ctx, "value must be uint16");
-      }
-    }
-    for (int i = 2; i < argc; i += 2) {
-      RedisModule_StringToLongLong(argv[i], &index);
-      RedisModule_StringToLongLong(argv[i + 1], &value);
-      *((uint16_t*)obj_ptr->mmap + index) = (uint16_t)value;
-    }
+  pthread_mutex_unlock(&MJobLock);
+  RedisModule_ReplySetArrayLength(ctx, jobs);
+  return REDISMODULE_OK;
+}
+
+// VJOBCANCEL id
+int VJobCancel_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
+{
+  RedisModule_AutoMemory(ctx); /* Use automatic memory management. */
+  if (argc != 2) return RedisModule_WrongArity(ctx);
+
+  long long id;
+  if (RedisModule_StringToLongLong(argv[1], &id) == REDISMODULE_ERR) {
+    return RedisModule_ReplyWithError(ctx, "id must be integer");
   }
-  else if (strcasecmp(obj_ptr->value_type, "int32") == 0) {
-    long long value;
-    for (int i = 3; i < argc; i += 2) {
-      if (RedisModule_StringToLongLong(argv[i], &value) == REDISMODULE_ERR) {
-        return RedisModule_ReplyWithError(ctx, "value must be integer");
-      }
-      if ((value < INT32_MIN) || (INT32_MAX < value)) {
-        return RedisModule_ReplyWithError(ctx, "value must be int32");
-      }
-    }
-    for (int i = 2; i < argc; i += 2) {
-      RedisModule_StringToLongLong(argv[i], &index);
-      RedisModule_StringToLongLong(argv[i + 1], &value);
-      *((int32_t*)obj_ptr->mmap + index) = (int32_t)value;
-    }
+
+  int cancelled = 0;
+  pthread_mutex_lock(&MJobLock);
+  for (MJob *job = MJobs; job != NULL; job = job->next_job) {
+    if (job->id != (uint64_t)id || job->finished) continue;
+    // stop handing out morsels, and finish now if none of them is running
+    job->cancelled = true;
+    job->morsels = job->next;
+    if (job->done == job->morsels) MJobFinishPass(job);
+    cancelled = 1;
+    break;
   }
-  else if (strcasecmp(obj_ptr->value_type, "uint32") == 0) {
-    long long value;
-    for (int i = 3; i < argc; i += 2) {
-      if (RedisModule_StringToLongLong(argv[i], &value) == REDISMODULE_ERR) {
-        return RedisModule_ReplyWithError(ctx, "value must be integer");
+  pthread_mutex_unlock(&MJobLock);
+  return RedisModule_ReplyWithLongLong(ctx, cancelled);
+}
+
+// VCONFIG GET pattern
+// VCONFIG SET name value
+int VConfig_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
+{
+  RedisModule_AutoMemory(ctx); /* Use automatic memory management. */
+  if (argc < 3) return RedisModule_WrongArity(ctx);
+
+  if (mstringcmp(argv[1], "get") == 0) {
+    if (argc != 3) return RedisModule_WrongArity(ctx);
+    const char *pattern = RedisModule_StringPtrLen(argv[2], NULL);
+    long len = 0;
+    RedisModule_ReplyWithArray(ctx, REDISMODULE_POSTPONED_ARRAY_LEN);
+    for (size_t i = 0; i < MCONFIG_NUM; ++i) {
+      if (fnmatch(pattern, MConfigs[i].name, FNM_CASEFOLD) != 0) continue;
+      RedisModule_ReplyWithSimpleString(ctx, MConfigs[i].name);
+      if (MConfigs[i].text != NULL) {
+        RedisModule_ReplyWithStringBuffer(ctx, MConfigs[i].text, strlen(MConfigs[i].text));
       }
-      if (value < 0 || UINT32_MAX < value) {
-        return RedisModule_ReplyWithError(ctx, "value must be uint32");
+      else if (MConfigs[i].names != NULL) {
+        RedisModule_ReplyWithSimpleString(ctx, MConfigs[i].names[*MConfigs[i].value - MConfigs[i].min]);
       }
+      else RedisModule_ReplyWithLongLong(ctx, *MConfigs[i].value);
+      len += 2;
     }
-    for (int i = 2; i < argc; i += 2) {
-      RedisModule_StringToLongLong(argv[i], &index);
-      RedisModule_StringToLongLong(argv[i + 1], &value);
-      *((uint32_t*)obj_ptr->mmap + index) = (uint32_t)value;
-    }
+    RedisModule_ReplySetArrayLength(ctx, len);
+    return REDISMODULE_OK;
   }
-  else if (strcasecmp(obj_ptr->value_type, "int64") == 0) {
-    long long value;
-    for (int i = 3; i < argc; i += 2) {
-      if (RedisModule_StringToLongLong(argv[i], &value) == REDISMODULE_ERR) {
-        return RedisModule_ReplyWithError(ctx, "value must be integer");
-      }
-      if (value < INT64_MIN || INT64_MAX < value) {
-        return RedisModule_ReplyWithError(ctx, "value must be int64");
-      }
-    }
-    for (int i = 2; i < argc; i += 2) {
-      RedisModule_StringToLongLong(argv[i], &index);
-      RedisModule_StringToLongLong(argv[i + 1], &value);
-      *((int64_t*)obj_ptr->mmap + index) = (int64_t)value;
-    }
+  if (mstringcmp(argv[1], "set") == 0) {
+    if (argc != 4) return RedisModule_WrongArity(ctx);
+    const char *err = MConfigSet(argv[2], argv[3], false);
+    if (err != NULL) return RedisModule_ReplyWithError(ctx, err);
+    return RedisModule_ReplyWithSimpleString(ctx, "OK");
   }
-  else if (strcasecmp(obj_ptr->value_type, "uint64") == 0) {
-    long long value;
-    for (int i = 3; i < argc; i += 2) {
-      if (RedisModule_StringToLongLong(argv[i], &value) == REDISMODULE_ERR) {
-        return RedisModule_ReplyWithError(ctx, "value must be integer");
-      }
-      if (value < 0) {
-        return RedisModule_ReplyWithError(ctx, "value must be uint64");
-      }
-    }
-    for (int i = 2; i < argc; i += 2) {
-      RedisModule_StringToLongLong(argv[i], &index);
-      RedisModule_StringToLongLong(argv[i + 1], &value);
-      *((uint64_t*)obj_ptr->mmap + index) = (uint64_t)value;
+  return RedisModule_ReplyWithError(ctx, "Argument must be \"get\" or \"set\"");
+}
+
+// VCLEAR key [release]
+int VClear_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
+{
+  RedisModule_AutoMemory(ctx); /* Use automatic memory management. */
+  if (argc != 2 && argc != 3) return RedisModule_WrongArity(ctx);
+  bool release = false;
+  if (argc == 3) {
+    if (mstringcmp(argv[2], "release") != 0) {
+      return RedisModule_ReplyWithError(ctx, "Argument must be \"release\"");
     }
+    release = true;
   }
-  else if (strcasecmp(obj_ptr->value_type, "float") == 0) {
-    double value;
-    for (int i = 3; i < argc; i += 2) {
-      if (RedisModule_StringToDouble(argv[i], &value) == REDISMODULE_ERR) {
-        return RedisModule_ReplyWithError(ctx, "value must be float");
-      }
-    }
-    for (int i = 2; i < argc; i += 2) {
-      RedisModule_StringToLongLong(argv[i], &index);
-      RedisModule_StringToDouble(argv[i + 1], &value);
-      *((float*)obj_ptr->mmap + index) = (float)value;
-    }
+
+  RedisModuleKey *key =
+      RedisModule_OpenKey(ctx, argv[1], REDISMODULE_READ | REDISMODULE_WRITE);
+  int type = RedisModule_KeyType(key);
+  if (type != REDISMODULE_KEYTYPE_EMPTY &&
+      RedisModule_ModuleTypeGetType(key) != MMapType) {
+    return RedisModule_ReplyWithError(ctx, REDISMODULE_ERRORMSG_WRONGTYPE);
   }
-  else if (strcasecmp(obj_ptr->value_type, "double") == 0) {
-    double value;
-    for (int i = 3; i < argc; i += 2) {
-      if (RedisModule_StringToDouble(argv[i], &value) == REDISMODULE_ERR) {
-        return RedisModule_ReplyWithError(ctx, "value must be double");
-      }
-    }
-    for (int i = 2; i < argc; i += 2) {
-      RedisModule_StringToLongLong(argv[i], &index);
-      RedisModule_StringToDouble(argv[i + 1], &value);
-      *((double*)obj_ptr->mmap + index) = (double)value;
-    }
+
+  if (type == REDISMODULE_KEYTYPE_EMPTY) {
+    return RedisModule_ReplyWithError(ctx, "You must do MMAP first");
   }
-  else if (strcasecmp(obj_ptr->value_type, "long_double") == 0) {
-    long double value;
-    for (int i = 3; i < argc; i += 2) {
-      if (RedisModule_StringToLongDouble(argv[i], &value) == REDISMODULE_ERR) {
-        return RedisModule_ReplyWithError(ctx, "value must be long double");
-      }
-    }
-    for (int i = 2; i < argc; i += 2) {
-      RedisModule_StringToLongLong(argv[i], &index);
-      RedisModule_StringToLongDouble(argv[i + 1], &value);
-      *((long double*)obj_ptr->mmap + index) = (long double)value;
-    }
+
+  MMapObject *obj_ptr = RedisModule_ModuleTypeGetValue(key);
+  if (obj_ptr == NULL) {
+    return RedisModule_ReplyWithNull(ctx);
   }
-  else if (strcasecmp(obj_ptr->value_type, "string") == 0) {
-    size_t value_size;
-    for (int i = 3; i < argc; i += 2) {
-      RedisModule_StringPtrLen(argv[i], &value_size);
-      if (obj_ptr->value_size < value_size) {
-        return RedisModule_ReplyWithError(ctx, "value is too long");
-      }
-    }
-    for (int i = 2; i < argc; i += 2) {
-      RedisModule_StringToLongLong(argv[i], &index);
-      char *value = zcalloc(obj_ptr->value_size + 1);
-      memcpy(value, RedisModule_StringPtrLen(argv[i + 1], &value_size), value_size);
-      memcpy((char*)obj_ptr->mmap + index * obj_ptr->value_size, value, obj_ptr->value_size);
-      zfree(value);
-    }
+
+  if (!obj_ptr->writable) {
+    return RedisModule_ReplyWithError(ctx, "The file is not writable");
   }
-  msync(obj_ptr->mmap, obj_ptr->file_size, MS_ASYNC);
-  return RedisModule_ReplyWithLongLong(ctx, (argc - 2) / 2);
-}
 
+  RedisModule_ReplyWithLongLong(ctx, MCount(obj_ptr));
+  MTruncate(obj_ptr, 0);
+  if (release) MResize(obj_ptr, 0);
+  MMarkDirty(ctx, obj_ptr, 0, 0, false);
+  MReplicateCommand(ctx, argv, argc);
+  return REDISMODULE_OK;
+}
 
-// VADD key value [value ...]
-int VAdd_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
+// VFILEPATH key
+int VFilePath_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
 {
   RedisModule_AutoMemory(ctx); /* Use automatic memory management. */
-
-  if (argc < 3) return RedisModule_WrongArity(ctx);
+  if (argc != 2) return RedisModule_WrongArity(ctx);
 
   RedisModuleKey *key =
       RedisModule_OpenKey(ctx, argv[1], REDISMODULE_READ | REDISMODULE_WRITE);
@@ -810,275 +3476,47 @@ int VAdd_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
       RedisModule_ModuleTypeGetType(key) != MMapType) {
     return RedisModule_ReplyWithError(ctx, REDISMODULE_ERRORMSG_WRONGTYPE);
   }
+
   if (type == REDISMODULE_KEYTYPE_EMPTY) {
     return RedisModule_ReplyWithError(ctx, "You must do MMAP first");
   }
 
   MMapObject *obj_ptr = RedisModule_ModuleTypeGetValue(key);
   if (obj_ptr == NULL) {
-    RedisModule_ReplyWithNull(ctx);
-    return REDISMODULE_ERR;
+    return RedisModule_ReplyWithNull(ctx);
   }
-  if (!obj_ptr->writable) {
-    return RedisModule_ReplyWithError(ctx, "The file is not writable");
+
+  return RedisModule_ReplyWithCString(ctx, obj_ptr->file_path);
+}
+
+// VTYPE key
+int VType_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
+{
+  RedisModule_AutoMemory(ctx); /* Use automatic memory management. */
+  if (argc != 2) return RedisModule_WrongArity(ctx);
+
+  RedisModuleKey *key =
+      RedisModule_OpenKey(ctx, argv[1], REDISMODULE_READ | REDISMODULE_WRITE);
+  int type = RedisModule_KeyType(key);
+  if (type != REDISMODULE_KEYTYPE_EMPTY &&
+      RedisModule_ModuleTypeGetType(key) != MMapType) {
+    return RedisModule_ReplyWithError(ctx, REDISMODULE_ERRORMSG_WRONGTYPE);
   }
 
-  if (strcasecmp(obj_ptr->value_type, "int8") == 0) {
-    long long value;
-    for (int i = 2; i < argc; ++i) {
-      if (RedisModule_StringToLongLong(argv[i], &value) == REDISMODULE_ERR) {
-        return RedisModule_ReplyWithError(ctx, "value must be integer");
-      }
-      if (value < INT8_MIN || INT8_MAX < value) {
-        return RedisModule_ReplyWithError(ctx, "value must be int8");
-      }
-    }
-    size_t new_size = obj_ptr->file_size + obj_ptr->value_size * (argc - 2);
-    ftruncate(obj_ptr->fd, new_size);
-    if (obj_ptr->mmap != NULL) munmap(obj_ptr->mmap, obj_ptr->file_size);
-    obj_ptr->mmap = mmap(NULL, new_size, PROT_READ | PROT_WRITE, MAP_SHARED, obj_ptr->fd, 0);
-    for (int i = 2; i < argc; ++i) {
-      size_t index = obj_ptr->file_size / obj_ptr->value_size;
-      RedisModule_StringToLongLong(argv[i], &value);
-      obj_ptr->file_size += obj_ptr->value_size;
-      *((int8_t*)obj_ptr->mmap + index) = (int8_t)value;
-    }
-  }
-  else if (strcasecmp(obj_ptr->value_type, "uint8") == 0) {
-    long long value;
-    for (int i = 2; i < argc; ++i) {
-      if (RedisModule_StringToLongLong(argv[i], &value) == REDISMODULE_ERR) {
-        return RedisModule_ReplyWithError(ctx, "value must be integer");
-      }
-      if (value < 0 || UINT8_MAX < value) {
-        return RedisModule_ReplyWithError(ctx, "value must be uint8");
-      }
-    }
-    size_t new_size = obj_ptr->file_size + obj_ptr->value_size * (argc - 2);
-    ftruncate(obj_ptr->fd, new_size);
-    if (obj_ptr->mmap != NULL) munmap(obj_ptr->mmap, obj_ptr->file_size);
-    obj_ptr->mmap = mmap(NULL, new_size, PROT_READ | PROT_WRITE, MAP_SHARED, obj_ptr->fd, 0);
-    for (int i = 2; i < argc; ++i) {
-      size_t index = obj_ptr->file_size / obj_ptr->value_size;
-      RedisModule_StringToLongLong(argv[i], &value);
-      obj_ptr->file_size += obj_ptr->value_size;
-      *((uint8_t*)obj_ptr->mmap + index) = (uint8_t)value;
-    }
-  }
-  else if (strcasecmp(obj_ptr->value_type, "int16") == 0) {
-    long long value;
-    for (int i = 2; i < argc; ++i) {
-      if (RedisModule_StringToLongLong(argv[i], &value) == REDISMODULE_ERR) {
-        return RedisModule_ReplyWithError(ctx, "value must be integer");
-      }
-      if (value < INT16_MIN || INT16_MAX < value) {
-        return RedisModule_ReplyWithError(ctx, "value must be int16");
-      }
-    }
-    size_t new_size = obj_ptr->file_size + obj_ptr->value_size * (argc - 2);
-    ftruncate(obj_ptr->fd, new_size);
-    if (obj_ptr->mmap != NULL) munmap(obj_ptr->mmap, obj_ptr->file_size);
-    obj_ptr->mmap = mmap(NULL, new_size, PROT_READ | PROT_WRITE, MAP_SHARED, obj_ptr->fd, 0);
-    for (int i = 2; i < argc; ++i) {
-      size_t index = obj_ptr->file_size / obj_ptr->value_size;
-      RedisModule_StringToLongLong(argv[i], &value);
-      obj_ptr->file_size += obj_ptr->value_size;
-      *((int16_t*)obj_ptr->mmap + index) = (int16_t)value;
-    }
-  }
-  else if (strcasecmp(obj_ptr->value_type, "uint16") == 0) {
-    long long value;
-    for (int i = 2; i < argc; ++i) {
-      if (RedisModule_StringToLongLong(argv[i], &value) == REDISMODULE_ERR) {
-        return RedisModule_ReplyWithError(ctx, "value must be integer");
-      }
-      if (value < 0 || UINT16_MAX < value) {
-        return RedisModule_ReplyWithError(ctx, "value must be uint16");
-      }
-    }
-    size_t new_size = obj_ptr->file_size + obj_ptr->value_size * (argc - 2);
-    ftruncate(obj_ptr->fd, new_size);
-    if (obj_ptr->mmap != NULL) munmap(obj_ptr->mmap, obj_ptr->file_size);
-    obj_ptr->mmap = mmap(NULL, new_size, PROT_READ | PROT_WRITE, MAP_SHARED, obj_ptr->fd, 0);
-    for (int i = 2; i < argc; ++i) {
-      size_t index = obj_ptr->file_size / obj_ptr->value_size;
-      RedisModule_StringToLongLong(argv[i], &value);
-      obj_ptr->file_size += obj_ptr->value_size;
-      *((uint16_t*)obj_ptr->mmap + index) = (uint16_t)value;
-    }
-  }
-  else if (strcasecmp(obj_ptr->value_type, "int32") == 0) {
-    long long value;
-    for (int i = 2; i < argc; ++i) {
-      if (RedisModule_StringToLongLong(argv[i], &value) == REDISMODULE_ERR) {
-        return RedisModule_ReplyWithError(ctx, "value must be integer");
-      }
-      if (value < INT32_MIN || INT32_MAX < value) {
-        return RedisModule_ReplyWithError(ctx, "value must be int32");
-      }
-    }
-    size_t new_size = obj_ptr->file_size + obj_ptr->value_size * (argc - 2);
-    ftruncate(obj_ptr->fd, new_size);
-    if (obj_ptr->mmap != NULL) munmap(obj_ptr->mmap, obj_ptr->file_size);
-    obj_ptr->mmap = mmap(NULL, new_size, PROT_READ | PROT_WRITE, MAP_SHARED, obj_ptr->fd, 0);
-    for (int i = 2; i < argc; ++i) {
-      size_t index = obj_ptr->file_size / obj_ptr->value_size;
-      RedisModule_StringToLongLong(argv[i], &value);
-      obj_ptr->file_size += obj_ptr->value_size;
-      *((int32_t*)obj_ptr->mmap + index) = (int32_t)value;
-    }
-  }
-  else if (strcasecmp(obj_ptr->value_type, "uint32") == 0) {
-    long long value;
-    for (int i = 2; i < argc; ++i) {
-      if (RedisModule_StringToLongLong(argv[i], &value) == REDISMODULE_ERR) {
-        return RedisModule_ReplyWithError(ctx, "value must be integer");
-      }
-      if (value < 0 || UINT32_MAX < value) {
-        return RedisModule_ReplyWithError(ctx, "value must be uint32");
-      }
-    }
-    size_t new_size = obj_ptr->file_size + obj_ptr->value_size * (argc - 2);
-    ftruncate(obj_ptr->fd, new_size);
-    if (obj_ptr->mmap != NULL) munmap(obj_ptr->mmap, obj_ptr->file_size);
-    obj_ptr->mmap = mmap(NULL, new_size, PROT_READ | PROT_WRITE, MAP_SHARED, obj_ptr->fd, 0);
-    for (int i = 2; i < argc; ++i) {
-      size_t index = obj_ptr->file_size / obj_ptr->value_size;
-      RedisModule_StringToLongLong(argv[i], &value);
-      obj_ptr->file_size += obj_ptr->value_size;
-      *((uint32_t*)obj_ptr->mmap + index) = (uint32_t)value;
-    }
-  }
-  else if (strcasecmp(obj_ptr->value_type, "int64") == 0) {
-    long long value;
-    for (int i = 2; i < argc; ++i) {
-      if (RedisModule_StringToLongLong(argv[i], &value) == REDISMODULE_ERR) {
-        return RedisModule_ReplyWithError(ctx, "value must be integer");
-      }
-      if (value < INT64_MIN || INT64_MAX < value) {
-        return RedisModule_ReplyWithError(ctx, "value must be int64");
-      }
-    }
-    size_t new_size = obj_ptr->file_size + obj_ptr->value_size * (argc - 2);
-    ftruncate(obj_ptr->fd, new_size);
-    if (obj_ptr->mmap != NULL) munmap(obj_ptr->mmap, obj_ptr->file_size);
-    obj_ptr->mmap = mmap(NULL, new_size, PROT_READ | PROT_WRITE, MAP_SHARED, obj_ptr->fd, 0);
-    for (int i = 2; i < argc; ++i) {
-      size_t index = obj_ptr->file_size / obj_ptr->value_size;
-      RedisModule_StringToLongLong(argv[i], &value);
-      obj_ptr->file_size += obj_ptr->value_size;
-      *((int64_t*)obj_ptr->mmap + index) = (int64_t)value;
-    }
-  }
-  else if (strcasecmp(obj_ptr->value_type, "uint64") == 0) {
-    long long value;
-    for (int i = 2; i < argc; ++i) {
-      if (RedisModule_StringToLongLong(argv[i], &value) == REDISMODULE_ERR) {
-        return RedisModule_ReplyWithError(ctx, "value must be integer");
-      }
-      if (value < 0) {
-        return RedisModule_ReplyWithError(ctx, "value must be uint64");
-      }
-    }
-    size_t new_size = obj_ptr->file_size + obj_ptr->value_size * (argc - 2);
-    ftruncate(obj_ptr->fd, new_size);
-    if (obj_ptr->mmap != NULL) munmap(obj_ptr->mmap, obj_ptr->file_size);
-    obj_ptr->mmap = mmap(NULL, new_size, PROT_READ | PROT_WRITE, MAP_SHARED, obj_ptr->fd, 0);
-    for (int i = 2; i < argc; ++i) {
-      size_t index = obj_ptr->file_size / obj_ptr->value_size;
-      RedisModule_StringToLongLong(argv[i], &value);
-      obj_ptr->file_size += obj_ptr->value_size;
-      *((uint64_t*)obj_ptr->mmap + index) = (uint64_t)value;
-    }
-  }
-  else if (strcasecmp(obj_ptr->value_type, "float") == 0) {
-    double value;
-    for (int i = 2; i < argc; ++i) {
-      if (RedisModule_StringToDouble(argv[i], &value) == REDISMODULE_ERR) {
-        return RedisModule_ReplyWithError(ctx, "value must be float");
-      }
-      fprintf(stderr, "%d:%f %f %f\n", __LINE__, value, -FLT_MAX, FLT_MAX);
-      if (value < -FLT_MAX || FLT_MAX < value) {
-        return RedisModule_ReplyWithError(ctx, "value must be float");
-      }
-    }
-    size_t new_size = obj_ptr->file_size + obj_ptr->value_size * (argc - 2);
-    ftruncate(obj_ptr->fd, new_size);
-    if (obj_ptr->mmap != NULL) munmap(obj_ptr->mmap, obj_ptr->file_size);
-    obj_ptr->mmap = mmap(NULL, new_size, PROT_READ | PROT_WRITE, MAP_SHARED, obj_ptr->fd, 0);
-    for (int i = 2; i < argc; ++i) {
-      size_t index = obj_ptr->file_size / obj_ptr->value_size;
-      RedisModule_StringToDouble(argv[i], &value);
-      obj_ptr->file_size += obj_ptr->value_size;
-      *((float*)obj_ptr->mmap + index) = (float)value;
-    }
-  }
-  else if (strcasecmp(obj_ptr->value_type, "double") == 0) {
-    long double value;
-    for (int i = 2; i < argc; ++i) {
-      if (RedisModule_StringToLongDouble(argv[i], &value) == REDISMODULE_ERR) {
-        return RedisModule_ReplyWithError(ctx, "value must be double");
-      }
-      if (value < -DBL_MAX || DBL_MAX < value) {
-        return RedisModule_ReplyWithError(ctx, "value must be double");
-      }
-    }
-    size_t new_size = obj_ptr->file_size + obj_ptr->value_size * (argc - 2);
-    ftruncate(obj_ptr->fd, new_size);
-    if (obj_ptr->mmap != NULL) munmap(obj_ptr->mmap, obj_ptr->file_size);
-    obj_ptr->mmap = mmap(NULL, new_size, PROT_READ | PROT_WRITE, MAP_SHARED, obj_ptr->fd, 0);
-    for (int i = 2; i < argc; ++i) {
-      size_t index = obj_ptr->file_size / obj_ptr->value_size;
-      RedisModule_StringToLongDouble(argv[i], &value);
-      obj_ptr->file_size += obj_ptr->value_size;
-      *((double*)obj_ptr->mmap + index) = (double)value;
-    }
-  }
-  else if (strcasecmp(obj_ptr->value_type, "long_double") == 0) {
-    long double value;
-    for (int i = 2; i < argc; ++i) {
-      if (RedisModule_StringToLongDouble(argv[i], &value) == REDISMODULE_ERR) {
-        return RedisModule_ReplyWithError(ctx, "value must be long double");
-      }
-    }
-    size_t new_size = obj_ptr->file_size + obj_ptr->value_size * (argc - 2);
-    ftruncate(obj_ptr->fd, new_size);
-    if (obj_ptr->mmap != NULL) munmap(obj_ptr->mmap, obj_ptr->file_size);
-    obj_ptr->mmap = mmap(NULL, new_size, PROT_READ | PROT_WRITE, MAP_SHARED, obj_ptr->fd, 0);
-    for (int i = 2; i < argc; ++i) {
-      size_t index = obj_ptr->file_size / obj_ptr->value_size;
-      RedisModule_StringToLongDouble(argv[i], &value);
-      obj_ptr->file_size += obj_ptr->value_size;
-      *((long double*)obj_ptr->mmap + index) = (long double)value;
-    }
-  }
-  else if (strcasecmp(obj_ptr->value_type, "string") == 0) {
-    size_t value_size;
-    for (int i = 2; i < argc; ++i) {
-      RedisModule_StringPtrLen(argv[i], &value_size);
-      if (obj_ptr->value_size < value_size) {
-        return RedisModule_ReplyWithError(ctx, "value is too long");
-      }
-    }
-    size_t new_size = obj_ptr->file_size + obj_ptr->value_size * (argc - 2);
-    ftruncate(obj_ptr->fd, new_size);
-    if (obj_ptr->mmap != NULL) munmap(obj_ptr->mmap, obj_ptr->file_size);
-    obj_ptr->mmap = mmap(NULL, new_size, PROT_READ | PROT_WRITE, MAP_SHARED, obj_ptr->fd, 0);
-    for (int i = 2; i < argc; ++i) {
-      size_t index = obj_ptr->file_size / obj_ptr->value_size;
-      char *value = zcalloc(obj_ptr->value_size + 1);
-      memcpy(value, RedisModule_StringPtrLen(argv[i], &value_size), value_size);
-      memcpy((char*)obj_ptr->mmap + index * obj_ptr->value_size, value, obj_ptr->value_size);
-      obj_ptr->file_size += obj_ptr->value_size;
-      zfree(value);
-    }
+  if (type == REDISMODULE_KEYTYPE_EMPTY) {
+    return RedisModule_ReplyWithError(ctx, "You must do MMAP first");
+  }
+
+  MMapObject *obj_ptr = RedisModule_ModuleTypeGetValue(key);
+  if (obj_ptr == NULL) {
+    return RedisModule_ReplyWithNull(ctx);
   }
-  msync(obj_ptr->mmap, obj_ptr->file_size, MS_ASYNC);
-  return RedisModule_ReplyWithLongLong(ctx, argc - 2);
+
+  return RedisModule_ReplyWithCString(ctx, obj_ptr->ops->name);
 }
 
-// VCOUNT key
-int VCount_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
+// VSIZE key
+int VSize_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
 {
   RedisModule_AutoMemory(ctx); /* Use automatic memory management. */
   if (argc != 2) return RedisModule_WrongArity(ctx);
@@ -1100,14 +3538,20 @@ int VCount_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
     return RedisModule_ReplyWithNull(ctx);
   }
 
-  return RedisModule_ReplyWithLongLong(ctx, obj_ptr->file_size / obj_ptr->value_size);
+  return RedisModule_ReplyWithLongLong(ctx, obj_ptr->value_size);
 }
 
-// VCLEAR key
-int VClear_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
+// VPOP key [count]
+int VPop_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
 {
   RedisModule_AutoMemory(ctx); /* Use automatic memory management. */
-  if (argc != 2) return RedisModule_WrongArity(ctx);
+  if (argc != 2 && argc != 3) return RedisModule_WrongArity(ctx);
+
+  long long pop_count = 1;
+  if (argc == 3 &&
+      (RedisModule_StringToLongLong(argv[2], &pop_count) == REDISMODULE_ERR || pop_count <= 0)) {
+    return RedisModule_ReplyWithError(ctx, "count must be positive integer");
+  }
 
   RedisModuleKey *key =
       RedisModule_OpenKey(ctx, argv[1], REDISMODULE_READ | REDISMODULE_WRITE);
@@ -1130,19 +3574,34 @@ int VClear_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
     return RedisModule_ReplyWithError(ctx, "The file is not writable");
   }
 
-  if (obj_ptr->mmap != NULL) munmap(obj_ptr->mmap, obj_ptr->file_size);
-  ftruncate(obj_ptr->fd, 0);
-  obj_ptr->mmap = NULL;
-  RedisModule_ReplyWithLongLong(ctx, obj_ptr->file_size / obj_ptr->value_size);
-  obj_ptr->file_size = 0;
+  size_t count = MCount(obj_ptr);
+  if (count == 0) {
+    return argc == 3 ? RedisModule_ReplyWithNullArray(ctx) : RedisModule_ReplyWithNull(ctx);
+  }
+  if (count < (size_t)pop_count) pop_count = count;
+
+  // the values stay in the mapping, only the logical size shrinks
+  if (argc == 3) RedisModule_ReplyWithArray(ctx, pop_count);
+  for (long long i = 0; i < pop_count; ++i) {
+    obj_ptr->ops->reply(ctx, MElement(obj_ptr, count - 1 - i), obj_ptr->value_size);
+  }
+  MTruncate(obj_ptr, (count - pop_count) * obj_ptr->value_size);
+  MShrinkLazily(obj_ptr);
+  MMarkDirty(ctx, obj_ptr, 0, 0, false);
+  RedisModule_Replicate(ctx, "VTRUNCATE", "sl", argv[1], (long long)(count - pop_count));
   return REDISMODULE_OK;
 }
 
-// VFILEPATH key
-int VFilePath_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
+// VTRUNCATE key count
+int VTruncate_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
 {
   RedisModule_AutoMemory(ctx); /* Use automatic memory management. */
-  if (argc != 2) return RedisModule_WrongArity(ctx);
+  if (argc != 3) return RedisModule_WrongArity(ctx);
+
+  long long new_count;
+  if (RedisModule_StringToLongLong(argv[2], &new_count) == REDISMODULE_ERR || new_count < 0) {
+    return RedisModule_ReplyWithError(ctx, "count must be non-negative integer");
+  }
 
   RedisModuleKey *key =
       RedisModule_OpenKey(ctx, argv[1], REDISMODULE_READ | REDISMODULE_WRITE);
@@ -1161,17 +3620,58 @@ int VFilePath_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int ar
     return RedisModule_ReplyWithNull(ctx);
   }
 
-  return RedisModule_ReplyWithCString(ctx, obj_ptr->file_path);
+  if (!obj_ptr->writable) {
+    return RedisModule_ReplyWithError(ctx, "The file is not writable");
+  }
+
+  size_t count = MCount(obj_ptr);
+  if (count < (size_t)new_count) {
+    return RedisModule_ReplyWithError(ctx, "count exceeds size");
+  }
+  MTruncate(obj_ptr, (size_t)new_count * obj_ptr->value_size);
+  MShrinkLazily(obj_ptr);
+  MMarkDirty(ctx, obj_ptr, 0, 0, false);
+  MReplicateCommand(ctx, argv, argc);
+  return RedisModule_ReplyWithLongLong(ctx, count - new_count);
 }
 
-// VTYPE key
-int VType_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
+// reply the ranges of obj_ptr written after its dirty epoch, and start a new one if reset
+static int MReplyDirty(RedisModuleCtx *ctx, MMapObject *obj_ptr, bool reset)
+{
+  // the dropped values are reported too, past the logical end
+  MFile *file = obj_ptr->file;
+  size_t end = file->file_size < file->dropped_end ? file->dropped_end : file->file_size;
+  MRunList runs = {NULL, 0, 0};
+  MDirtyRuns(file, obj_ptr->dirty_epoch, 0, end, &runs);
+  if (reset) obj_ptr->dirty_epoch = MTakeEpoch(file);
+
+  // the blocks as ranges of values, up to the end
+  size_t count = end / obj_ptr->value_size;
+  long len = 0;
+  RedisModule_ReplyWithArray(ctx, REDISMODULE_POSTPONED_ARRAY_LEN);
+  for (size_t i = 0; i < runs.len; ++i) {
+    size_t start = runs.runs[i].offset / obj_ptr->value_size;
+    size_t stop = (runs.runs[i].offset + runs.runs[i].len + obj_ptr->value_size - 1) / obj_ptr->value_size;
+    if (count < stop) stop = count;
+    if (stop <= start) continue;
+    RedisModule_ReplyWithArray(ctx, 2);
+    RedisModule_ReplyWithLongLong(ctx, start);
+    RedisModule_ReplyWithLongLong(ctx, stop - start);
+    ++len;
+  }
+  RedisModule_ReplySetArrayLength(ctx, len);
+  zfree(runs.runs);
+  return REDISMODULE_OK;
+}
+
+// VDIRTY key
+int VDirty_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
 {
   RedisModule_AutoMemory(ctx); /* Use automatic memory management. */
   if (argc != 2) return RedisModule_WrongArity(ctx);
 
   RedisModuleKey *key =
-      RedisModule_OpenKey(ctx, argv[1], REDISMODULE_READ | REDISMODULE_WRITE);
+      RedisModule_OpenKey(ctx, argv[1], REDISMODULE_READ);
   int type = RedisModule_KeyType(key);
   if (type != REDISMODULE_KEYTYPE_EMPTY &&
       RedisModule_ModuleTypeGetType(key) != MMapType) {
@@ -1187,11 +3687,11 @@ int VType_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
     return RedisModule_ReplyWithNull(ctx);
   }
 
-  return RedisModule_ReplyWithCString(ctx, obj_ptr->value_type);
+  return MReplyDirty(ctx, obj_ptr, false);
 }
 
-// VSIZE key
-int VSize_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
+// VDIRTYRESET key
+int VDirtyReset_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
 {
   RedisModule_AutoMemory(ctx); /* Use automatic memory management. */
   if (argc != 2) return RedisModule_WrongArity(ctx);
@@ -1213,11 +3713,13 @@ int VSize_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
     return RedisModule_ReplyWithNull(ctx);
   }
 
-  return RedisModule_ReplyWithLongLong(ctx, obj_ptr->value_size);
+  // a replica reports the changes since the same reset
+  MReplicateCommand(ctx, argv, argc);
+  return MReplyDirty(ctx, obj_ptr, true);
 }
 
-// VPOP key
-int VPop_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
+// VSHRINK key
+int VShrink_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
 {
   RedisModule_AutoMemory(ctx); /* Use automatic memory management. */
   if (argc != 2) return RedisModule_WrongArity(ctx);
@@ -1243,219 +3745,345 @@ int VPop_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
     return RedisModule_ReplyWithError(ctx, "The file is not writable");
   }
 
-  if (obj_ptr->file_size == 0) {
-    RedisModule_ReplyWithNull(ctx);
+  if (MResize(obj_ptr, obj_ptr->file->file_size) == -1) {
+    return RedisModule_ReplyWithError(ctx, "Can't shrink the file");
   }
-  else {
-    size_t index = obj_ptr->file_size / obj_ptr->value_size - 1;
-    if (strcasecmp(obj_ptr->value_type, "int8") == 0) {
-      RedisModule_ReplyWithLongLong(ctx, ((int8_t*)obj_ptr->mmap)[index]);
-    }
-    else if (strcasecmp(obj_ptr->value_type, "uint8") == 0) {
-      RedisModule_ReplyWithLongLong(ctx, ((uint8_t*)obj_ptr->mmap)[index]);
-    }
-    else if (strcasecmp(obj_ptr->value_type, "int16") == 0) {
-      RedisModule_ReplyWithLongLong(ctx, ((int16_t*)obj_ptr->mmap)[index]);
-    }
-    else if (strcasecmp(obj_ptr->value_type, "uint16") == 0) {
-      RedisModule_ReplyWithLongLong(ctx, ((uint16_t*)obj_ptr->mmap)[index]);
-    }
-    else if (strcasecmp(obj_ptr->value_type, "int32") == 0) {
-      RedisModule_ReplyWithLongLong(ctx, ((int32_t*)obj_ptr->mmap)[index]);
-    }
-    else if (strcasecmp(obj_ptr->value_type, "uint32") == 0) {
-      RedisModule_ReplyWithLongLong(ctx, ((uint32_t*)obj_ptr->mmap)[index]);
-    }
-    else if (strcasecmp(obj_ptr->value_type, "int64") == 0) {
-      RedisModule_ReplyWithLongLong(ctx, ((int64_t*)obj_ptr->mmap)[index]);
-    }
-    else if (strcasecmp(obj_ptr->value_type, "uint64") == 0) {
-      RedisModule_ReplyWithLongLong(ctx, ((uint64_t*)obj_ptr->mmap)[index]);
-    }
-    else if (strcasecmp(obj_ptr->value_type, "float") == 0) {
-      RedisModule_ReplyWithDouble(ctx, ((float*)obj_ptr->mmap)[index]);
-    }
-    else if (strcasecmp(obj_ptr->value_type, "double") == 0) {
-      RedisModule_ReplyWithDouble(ctx, ((double*)obj_ptr->mmap)[index]);
-    }
-    else if (strcasecmp(obj_ptr->value_type, "long_double") == 0) {
-      RedisModule_ReplyWithLongDouble(ctx, ((long double*)obj_ptr->mmap)[index]);
-    }
-    else if (strcasecmp(obj_ptr->value_type, "string") == 0) {
-      char *buffer = zcalloc(obj_ptr->value_size +1);
-      snprintf(buffer, obj_ptr->value_size + 1, "%s", (char *)obj_ptr->mmap + index * obj_ptr->value_size);
-      RedisModule_ReplyWithStringBuffer(ctx, buffer, strlen(buffer));
-      zfree(buffer);
-    }
-    else return REDISMODULE_ERR;
-    if (obj_ptr->mmap != NULL) munmap(obj_ptr->mmap, obj_ptr->file_size);
-    obj_ptr->file_size -= obj_ptr->value_size;
-    ftruncate(obj_ptr->fd, obj_ptr->file_size);
-    if (0 < obj_ptr->file_size) {
-      obj_ptr->mmap = mmap(NULL, obj_ptr->file_size, PROT_READ | PROT_WRITE, MAP_SHARED, obj_ptr->fd, 0);
+  MReplicateCommand(ctx, argv, argc);
+  return RedisModule_ReplyWithLongLong(ctx, obj_ptr->file->capacity / obj_ptr->value_size);
+}
+
+// version of the RDB format, 1 adds the embedded files
+#define MRDB_ENCVER 1
+
+// flags saved after value_size
+#define MRDB_WRITABLE 1
+#define MRDB_FOLLOW 2
+#define MRDB_HEADER 4
+#define MRDB_EMBED 8  // the key was mapped with embed
+#define MRDB_DATA 16  // the header and the values of the file follow the flags
+
+// bytes of values in one string of an embedded file
+#define MRDB_CHUNK (4 << 20)
+
+// append key to target as one path component: '/', '%', NUL and a leading '.' are
+// written as %XX, so that a key can't name another directory, as "../x" would
+static sds MCatKeyComponent(sds target, const char *key, size_t len)
+{
+  for (size_t i = 0; i < len; ++i) {
+    char c = key[i];
+    if (c == '/' || c == '%' || c == '\0' || (i == 0 && c == '.')) {
+      target = sdscatprintf(target, "%%%02X", (unsigned char)c);
     }
-    else obj_ptr->mmap = NULL;
+    else target = sdscatlen(target, &c, 1);
   }
-  return REDISMODULE_OK;
+  return target;
 }
 
-void *MRdbLoad(RedisModuleIO *rdb, int encver)
+// the path where the file of key embedded in RDB is written, from embed-path
+static sds MEmbedTarget(const char *file_path, const RedisModuleString *key)
 {
-  // if (encver != 0) {
-  //   RedisModule_Log(rdb->ctx, "warning", "Can't load data with version %d",
-  //                   encver);
-  //   return NULL;
-  // }
-  MMapObject *obj_ptr = MCreateObject();
-  obj_ptr->file_path = sdsnew(RedisModule_StringPtrLen(RedisModule_LoadString(rdb), NULL));
-  obj_ptr->value_type = sdsnew(RedisModule_StringPtrLen(RedisModule_LoadString(rdb), NULL));
-  uint64_t value_size = RedisModule_LoadUnsigned(rdb);
-  obj_ptr->value_size = (uint8_t)value_size;
-  uint64_t writable = RedisModule_LoadUnsigned(rdb);
-  obj_ptr->writable = (writable == 0 ? false : true);
-  if (obj_ptr->writable) {
-    obj_ptr->fd = open(obj_ptr->file_path, O_CREAT | O_RDWR, 0666);
+  const char *base = strrchr(file_path, '/');
+  base = base == NULL ? file_path : base + 1;
+  size_t key_len = 0;
+  const char *key_name = key != NULL ? RedisModule_StringPtrLen(key, &key_len) : "";
+  sds target = sdsempty();
+  for (const char *p = MEmbedPath; *p != '\0';) {
+    if (strncmp(p, "{path}", 6) == 0) {
+      target = sdscat(target, file_path);
+      p += 6;
+    }
+    else if (strncmp(p, "{base}", 6) == 0) {
+      target = sdscat(target, base);
+      p += 6;
+    }
+    else if (strncmp(p, "{key}", 5) == 0) {
+      target = MCatKeyComponent(target, key_name, key_len);
+      p += 5;
+    }
+    else target = sdscatlen(target, p++, 1);
   }
-  else {
-    obj_ptr->fd = open(obj_ptr->file_path, O_RDONLY);
+  return target;
+}
+
+// save the header and the values of file in chunks, straight from the mapping
+static void MRdbSaveFile(RedisModuleIO *rdb, const MFile *file)
+{
+  RedisModule_SaveUnsigned(rdb, file->offset);
+  if (file->header != NULL) {
+    // the saved values are the only commit, the other slot is left invalid
+    MHeader header;
+    memcpy(&header, file->header, sizeof(header));
+    memset(header.commits, 0, sizeof(header.commits));
+    MCommit commit = {file->commit_seq, file->file_size / header.value_size, file->file_size, 0};
+    commit.checksum = MChecksum(&commit, offsetof(MCommit, checksum));
+    header.commits[commit.seq & 1] = commit;
+    RedisModule_SaveStringBuffer(rdb, (const char *)&header, sizeof(header));
   }
-  if (obj_ptr->fd == -1) {
-    MFree(obj_ptr);
-    return NULL;
+  RedisModule_SaveUnsigned(rdb, file->file_size);
+  const char *values = file->mmap;
+  for (size_t offset = 0; offset < file->file_size; offset += MRDB_CHUNK) {
+    size_t len = file->file_size - offset < MRDB_CHUNK ? file->file_size - offset : MRDB_CHUNK;
+    RedisModule_SaveStringBuffer(rdb, values + offset, len);
   }
+}
+
+// the file at fd already has the header and the number of values saved by MRdbSaveFile
+// header is NULL if the file has none, and the values are compared as they are loaded
+static bool MSameFile(int fd, const char *target, const char *header, size_t offset, size_t file_size)
+{
   struct stat sb;
-  if (fstat(obj_ptr->fd, &sb) == -1) {
-    MFree(obj_ptr);
-    return NULL;
+  if (fstat(fd, &sb) == -1) return false;
+  if (header == NULL) {
+    // a sidecar would give another logical size
+    sds sidecar_path = MSidecarPath(target);
+    bool sidecar = access(sidecar_path, F_OK) == 0;
+    sdsfree(sidecar_path);
+    return !sidecar && (size_t)sb.st_size == file_size;
   }
-  obj_ptr->file_size = sb.st_size;
-  if (0 < obj_ptr->file_size) {
-    if (obj_ptr->writable) {
-      obj_ptr->mmap = mmap(NULL, sb.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, obj_ptr->fd, 0);
-    }
-    else {
-      obj_ptr->mmap = mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, obj_ptr->fd, 0);
-    }
-    if (obj_ptr->mmap == MAP_FAILED) {
-      MFree(obj_ptr);
-      return NULL;
-    }
+  MHeader disk;
+  MCommit commit;
+  if ((size_t)sb.st_size < offset + file_size ||
+      pread(fd, &disk, sizeof(disk), 0) != sizeof(disk) ||
+      memcmp(&disk, header, offsetof(MHeader, commits)) != 0 ||
+      !MLatestCommit(&disk, sb.st_size - offset, &commit)) {
+    return false;
   }
-  else obj_ptr->mmap = NULL;
-  return obj_ptr;
+  return commit.count * disk.value_size == file_size;
 }
 
-void MRdbSave(RedisModuleIO *rdb, void *value)
+// create the temporary file with header and the first done bytes of values, which are the same
+// in the file at same_fd. return its descriptor, or -1
+static int MStartCopy(const char *tmp_path, int same_fd, const char *header, size_t header_len,
+                      size_t offset, size_t done)
 {
-  MMapObject *obj_ptr = value;
-  RedisModule_SaveStringBuffer(rdb, obj_ptr->file_path, sdslen(obj_ptr->file_path));
-  RedisModule_SaveStringBuffer(rdb, obj_ptr->value_type, sdslen(obj_ptr->value_type));
-  RedisModule_SaveUnsigned(rdb, obj_ptr->value_size);
-  RedisModule_SaveUnsigned(rdb, obj_ptr->writable ? 1 : 0);
-  msync(obj_ptr->mmap, obj_ptr->file_size, MS_ASYNC);
+  int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  if (fd == -1) return -1;
+  bool failed = ftruncate(fd, offset) == -1 ||
+                (header_len > 0 && pwrite(fd, header, header_len, 0) != (ssize_t)header_len);
+  char *buffer = done > 0 ? zmalloc(MRDB_CHUNK) : NULL;
+  for (size_t copied = 0; !failed && copied < done;) {
+    size_t len = done - copied < MRDB_CHUNK ? done - copied : MRDB_CHUNK;
+    failed = pread(same_fd, buffer, len, offset + copied) != (ssize_t)len ||
+             pwrite(fd, buffer, len, offset + copied) != (ssize_t)len;
+    copied += len;
+  }
+  zfree(buffer);
+  if (failed) {
+    close(fd);
+    unlink(tmp_path);
+    return -1;
+  }
+  return fd;
 }
 
-void MAofRewrite(RedisModuleIO *aof, RedisModuleString *key, void *value)
+static uint64_t MLoadSeq = 0;  // counts the loads, see MLoadingEvent
+
+static void MLoadingEvent(RedisModuleCtx *ctx, RedisModuleEvent e, uint64_t sub, void *data)
 {
-  char buffer[0x200];
-  MMapObject *obj_ptr = (MMapObject*)value;
-  RedisModule_EmitAOF(aof, "MMAP", "scclc",
-                      key,
-                      obj_ptr->file_path,
-                      obj_ptr->value_type,
-                      obj_ptr->value_size,
-                      "writable");
-  RedisModule_EmitAOF(aof, "MCLEAR", "ss", key, obj_ptr->file_path);
-  if (strcasecmp(obj_ptr->value_type, "int8") == 0) {
-    for (size_t i = 0; i < obj_ptr->file_size; i += sizeof(int8_t)) {
-      int8_t value = ((int8_t*)obj_ptr->mmap)[i];
-      RedisModule_EmitAOF(aof, "MADD", "sbl", key, value);
-    }
+  REDISMODULE_NOT_USED(ctx);
+  REDISMODULE_NOT_USED(e);
+  REDISMODULE_NOT_USED(data);
+  if (sub == REDISMODULE_SUBEVENT_LOADING_RDB_START || sub == REDISMODULE_SUBEVENT_LOADING_AOF_START ||
+      sub == REDISMODULE_SUBEVENT_LOADING_REPL_START) {
+    ++MLoadSeq;
   }
-  else if (strcasecmp(obj_ptr->value_type, "uint8") == 0) {
-    for (size_t i = 0; i < obj_ptr->file_size; i += sizeof(uint8_t)) {
-      uint8_t value = ((uint8_t*)obj_ptr->mmap)[i];
-      RedisModule_EmitAOF(aof, "MADD", "sbl", key, value);
+}
+
+// write the file saved by MRdbSaveFile to target through a temporary file, one chunk at a time
+// target is left as it is if it has the same values, as when the RDB is loaded where it was saved
+// the chunks are read even if the file can't be written. *shared is set if they are skipped
+// since a key of this load already maps target. return -1 on failure
+static int MRdbLoadFile(RedisModuleIO *rdb, const char *target, bool *shared)
+{
+  // the keys of a lazy flush still hold their files until they are freed, and they
+  // may have other values than the loaded ones
+  MDrainFreeQueue();
+  // keys sharing a file embed it each, and the first of them writes it
+  // a file opened before the load is compared like any other, its values may be stale
+  struct stat sb;
+  bool opened = false;
+  if (MLoadSeq != 0 && stat(target, &sb) == 0) {
+    for (MFile *file = MFiles; file != NULL; file = file->next) {
+      if (file->dev == sb.st_dev && file->ino == sb.st_ino && file->refs > 0 &&
+          file->load_seq == MLoadSeq) {
+        opened = true;
+      }
     }
   }
-  else if (strcasecmp(obj_ptr->value_type, "int16") == 0) {
-    for (size_t i = 0; i < obj_ptr->file_size; i += sizeof(int16_t)) {
-      int16_t value = *(int16_t *)((uint8_t*)obj_ptr->mmap + i);
-      RedisModule_EmitAOF(aof, "MADD", "sbl", key, value);
-    }
+  *shared = opened;
+  sds tmp_path = sdscatprintf(sdsempty(), "%s.%d.tmp", target, (int)getpid());
+  bool failed = false;
+
+  uint64_t offset = RedisModule_LoadUnsigned(rdb);
+  char *header = NULL;
+  size_t header_len = 0;
+  if (offset > 0) header = RedisModule_LoadStringBuffer(rdb, &header_len);
+  uint64_t file_size = RedisModule_LoadUnsigned(rdb);
+
+  // compared with target until they differ, and then copied to the temporary file
+  int same_fd = opened ? -1 : open(target, O_RDONLY);
+  if (same_fd != -1 && !MSameFile(same_fd, target, header, offset, file_size)) {
+    close(same_fd);
+    same_fd = -1;
   }
-  else if (strcasecmp(obj_ptr->value_type, "uint16") == 0) {
-    for (size_t i = 0; i < obj_ptr->file_size; i += sizeof(uint16_t)) {
-      uint16_t value = *(uint16_t *)((uint8_t*)obj_ptr->mmap + i);
-      RedisModule_EmitAOF(aof, "MADD", "sbl", key, value);
-    }
+  int fd = -1;
+  if (!opened && same_fd == -1) {
+    fd = MStartCopy(tmp_path, -1, header, header_len, offset, 0);
+    failed = fd == -1;
   }
-  else if (strcasecmp(obj_ptr->value_type, "int32") == 0) {
-    for (size_t i = 0; i < obj_ptr->file_size; i += sizeof(int32_t)) {
-      int32_t value = *(int32_t *)((uint8_t*)obj_ptr->mmap + i);
-      RedisModule_EmitAOF(aof, "MADD", "sbl", key, value);
+  char *buffer = NULL;
+  for (uint64_t done = 0; done < file_size;) {
+    size_t len;
+    char *values = RedisModule_LoadStringBuffer(rdb, &len);
+    if (same_fd != -1) {
+      buffer = zrealloc(buffer, len);
+      if (pread(same_fd, buffer, len, offset + done) != (ssize_t)len || memcmp(buffer, values, len) != 0) {
+        fd = MStartCopy(tmp_path, same_fd, header, header_len, offset, done);
+        failed = fd == -1;
+        close(same_fd);
+        same_fd = -1;
+      }
     }
-  }
-  else if (strcasecmp(obj_ptr->value_type, "uint32") == 0) {
-    for (size_t i = 0; i < obj_ptr->file_size; i += sizeof(uint32_t)) {
-      uint32_t value = *(uint32_t *)((uint8_t*)obj_ptr->mmap + i);
-      RedisModule_EmitAOF(aof, "MADD", "sbl", key, value);
+    if (fd != -1 && !failed && pwrite(fd, values, len, offset + done) != (ssize_t)len) failed = true;
+    RedisModule_Free(values);
+    if (len == 0) {
+      failed = true;
+      break;
     }
+    done += len;
   }
-  else if (strcasecmp(obj_ptr->value_type, "int64") == 0) {
-    for (size_t i = 0; i < obj_ptr->file_size; i += sizeof(int64_t)) {
-      int64_t value = *(int64_t *)((uint8_t*)obj_ptr->mmap + i);
-      RedisModule_EmitAOF(aof, "MADD", "sbl", key, value);
+  zfree(buffer);
+  if (header != NULL) RedisModule_Free(header);
+  if (same_fd != -1) close(same_fd);
+
+  if (fd != -1) {
+    if (!failed && MFsyncPolicy != MFSYNC_NO && fdatasync(fd) == -1) failed = true;
+    close(fd);
+    if (!failed && rename(tmp_path, target) == 0) {
+      // the logical size of the old file doesn't apply to the new one
+      sds sidecar_path = MSidecarPath(target);
+      unlink(sidecar_path);
+      sdsfree(sidecar_path);
     }
-  }
-  else if (strcasecmp(obj_ptr->value_type, "uint64") == 0) {
-    for (size_t i = 0; i < obj_ptr->file_size; i += sizeof(uint64_t)) {
-      uint64_t value = *(uint64_t *)((uint8_t*)obj_ptr->mmap + i);
-      RedisModule_EmitAOF(aof, "MADD", "sbl", key, value);
+    else {
+      unlink(tmp_path);
+      failed = true;
     }
   }
-  else if (strcasecmp(obj_ptr->value_type, "float") == 0) {
-    for (size_t i = 0; i < obj_ptr->file_size; i += sizeof(float)) {
-      float value = *(float *)((uint8_t*)obj_ptr->mmap + i);
-      sprintf(buffer, "%.16f", value);
-      RedisModule_EmitAOF(aof, "MADD", "sbc", key, buffer);
-    }
+  sdsfree(tmp_path);
+  return failed ? -1 : 0;
+}
+
+void *MRdbLoad(RedisModuleIO *rdb, int encver)
+{
+  if (encver > MRDB_ENCVER) {
+    RedisModule_Log(RedisModule_GetContextFromIO(rdb), "warning", "Can't load data with version %d",
+                    encver);
+    return NULL;
   }
-  else if (strcasecmp(obj_ptr->value_type, "double") == 0) {
-    for (size_t i = 0; i < obj_ptr->file_size; i += sizeof(double)) {
-      double value = *(double *)((uint8_t*)obj_ptr->mmap + i);
-      sprintf(buffer, "%.16f", value);
-      RedisModule_EmitAOF(aof, "MADD", "sbc", key, buffer);
-    }
+  MMapObject *obj_ptr = MCreateObject();
+  obj_ptr->file_path = sdsnew(RedisModule_StringPtrLen(RedisModule_LoadString(rdb), NULL));
+  RedisModuleString *value_type = RedisModule_LoadString(rdb);
+  int type = MLookupType(RedisModule_StringPtrLen(value_type, NULL));
+  RedisModule_FreeString(NULL, value_type);
+  if (type < 0) {
+    MFree(obj_ptr);
+    return NULL;
   }
-  else if (strcasecmp(obj_ptr->value_type, "long_double") == 0) {
-    for (size_t i = 0; i < obj_ptr->file_size; i += sizeof(long double)) {
-      long double value = *(long double *)((uint8_t*)obj_ptr->mmap + i);
-      sprintf(buffer, "%.16Lf", value);
-      RedisModule_EmitAOF(aof, "MADD", "sbc", key, buffer);
-    }
+  obj_ptr->value_type = (MValueType)type;
+  obj_ptr->ops = &MTypeTable[type];
+  uint64_t value_size = RedisModule_LoadUnsigned(rdb);
+  obj_ptr->value_size = (uint8_t)value_size;
+  uint64_t flags = RedisModule_LoadUnsigned(rdb);
+  obj_ptr->writable = (flags & MRDB_WRITABLE) != 0;
+  obj_ptr->follow = (flags & MRDB_FOLLOW) != 0;
+  obj_ptr->header = (flags & MRDB_HEADER) != 0;
+  obj_ptr->embed = (flags & MRDB_EMBED) != 0;
+  bool loaded = false;
+  if (flags & MRDB_DATA) {
+    sds target = MEmbedTarget(obj_ptr->file_path, RedisModule_GetKeyNameFromIO(rdb));
+    sdsfree(obj_ptr->file_path);
+    obj_ptr->file_path = target;
+    // the file as it is, if any, is better than failing the whole load
+    bool shared;
+    if (MRdbLoadFile(rdb, target, &shared) == -1) {
+      RedisModule_Log(RedisModule_GetContextFromIO(rdb), "warning",
+                      "%s: Can't write the embedded file, the file is mapped as it is", target);
+    }
+    else if (shared) {
+      RedisModule_Log(RedisModule_GetContextFromIO(rdb), "warning",
+                      "%s: The embedded file isn't written, it is mapped by a key loaded before", target);
+    }
+    else loaded = true;
   }
-  else if (strcasecmp(obj_ptr->value_type, "string") == 0) {
-    char *buffer = zmalloc(obj_ptr->value_size + 1);
-    for (size_t i = 0; i < obj_ptr->file_size; i += obj_ptr->value_size) {
-      memset(buffer, 0, obj_ptr->value_size + 1);
-      snprintf(buffer, obj_ptr->value_size + 1, "%s", (char*)obj_ptr->mmap + i);
-      RedisModule_EmitAOF(aof, "MADD", "sbc", key, buffer);
-    }
-    zfree(buffer);
+  const char *err = MOpenFile(obj_ptr);
+  if (err != NULL) {
+    RedisModule_Log(RedisModule_GetContextFromIO(rdb), "warning", "%s: %s", obj_ptr->file_path, err);
+    MFree(obj_ptr);
+    return NULL;
   }
+  // the file has the loaded values, the next keys embedding it share it
+  if (loaded) obj_ptr->file->load_seq = MLoadSeq;
+  if (obj_ptr->follow) MFollowStart(RedisModule_GetContextFromIO(rdb));
+  return obj_ptr;
+}
 
-  if (!obj_ptr->writable) {
-    RedisModule_EmitAOF(aof, "DEL", "s", key);
-    RedisModule_EmitAOF(aof, "MMAP", "sss", key, obj_ptr->file_path, obj_ptr->value_type);
-  }
+void MRdbSave(RedisModuleIO *rdb, void *value)
+{
+  MMapObject *obj_ptr = value;
+  bool embed = obj_ptr->embed || MEmbedPolicy == MEMBED_ALL;
+  RedisModule_SaveStringBuffer(rdb, obj_ptr->file_path, sdslen(obj_ptr->file_path));
+  RedisModule_SaveStringBuffer(rdb, obj_ptr->ops->name, strlen(obj_ptr->ops->name));
+  RedisModule_SaveUnsigned(rdb, obj_ptr->value_size);
+  RedisModule_SaveUnsigned(rdb, (obj_ptr->writable ? MRDB_WRITABLE : 0) |
+                                (obj_ptr->follow ? MRDB_FOLLOW : 0) |
+                                (obj_ptr->file->header != NULL ? MRDB_HEADER : 0) |
+                                (obj_ptr->embed ? MRDB_EMBED : 0) |
+                                (embed ? MRDB_DATA : 0));
+  if (embed) MRdbSaveFile(rdb, obj_ptr->file);
+  msync(obj_ptr->file->mmap, obj_ptr->file->file_size, MS_ASYNC);
+}
+
+// bytes of values in one VADDRAW of the AOF
+#define MAOF_CHUNK (4 << 20)
 
+void MAofRewrite(RedisModuleIO *aof, RedisModuleString *key, void *value)
+{
+  MMapObject *obj_ptr = (MMapObject*)value;
+  // the options of MMAP after value_size. a read-only key finds the header by itself
+  const char *options[3] = {NULL, NULL, NULL};
+  int n = 0;
+  if (obj_ptr->writable) options[n++] = "writable";
+  if (obj_ptr->follow) options[n++] = "follow";
+  if (obj_ptr->writable && obj_ptr->file->header != NULL) options[n++] = "header";
+  if (obj_ptr->embed) options[n++] = "embed";
+  const char *fmt[] = {"sccl", "scclc", "scclcc", "scclccc"};
+  RedisModule_EmitAOF(aof, "MMAP", fmt[n], key, obj_ptr->file_path, obj_ptr->ops->name,
+                      (long long)obj_ptr->value_size, options[0], options[1], options[2]);
+  // the values of a read-only key are in its file
+  if (!obj_ptr->writable) return;
+
+  RedisModule_EmitAOF(aof, "VCLEAR", "s", key);
+  size_t chunk = MAOF_CHUNK / obj_ptr->value_size * obj_ptr->value_size;
+  const char *values = obj_ptr->file->mmap;
+  for (size_t offset = 0; offset < obj_ptr->file->file_size; offset += chunk) {
+    size_t len = obj_ptr->file->file_size - offset < chunk ? obj_ptr->file->file_size - offset : chunk;
+    RedisModule_EmitAOF(aof, "VADDRAW", "sb", key, values + offset, len);
+  }
 }
 
 size_t MMemUsage(const void *value)
 {
   const MMapObject *obj_ptr = value;
-  return obj_ptr->file_size;
+  return obj_ptr->file->file_size;
+}
+
+// UNLINK frees a key on the main thread, since closing its file touches the files of other keys
+size_t MFreeEffort(RedisModuleString *key, const void *value)
+{
+  REDISMODULE_NOT_USED(key);
+  REDISMODULE_NOT_USED(value);
+  return 1;
 }
 
 
@@ -1477,31 +4105,50 @@ void MDigest(RedisModuleDigest *md, void *value)
  * to register the commands into the Redis server. */
 int RedisModule_OnLoad(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
 {
-  REDISMODULE_NOT_USED(argv);
-  REDISMODULE_NOT_USED(argc);
-
   if (RedisModule_Init(ctx, "FuchiMMap", 1, REDISMODULE_APIVER_1) ==
       REDISMODULE_ERR)
     return REDISMODULE_ERR;
 
+  // loadmodule fmmap.so [name value ...]
+  if (argc % 2 != 0) {
+    RedisModule_Log(ctx, "warning", "Arguments must be name value pairs");
+    return REDISMODULE_ERR;
+  }
+  for (int i = 0; i < argc; i += 2) {
+    const char *err = MConfigSet(argv[i], argv[i + 1], true);
+    if (err != NULL) {
+      RedisModule_Log(ctx, "warning", "%s: %s", RedisModule_StringPtrLen(argv[i], NULL), err);
+      return REDISMODULE_ERR;
+    }
+  }
+
   RedisModuleTypeMethods tm = {.version = REDISMODULE_TYPE_METHOD_VERSION,
                                .rdb_load = MRdbLoad,
                                .rdb_save = MRdbSave,
                                .aof_rewrite = MAofRewrite,
                                .mem_usage = MMemUsage,
                                .free = MFree,
+                               .free_effort = MFreeEffort,
                                .digest = MDigest};
 
-  MMapType = RedisModule_CreateDataType(ctx, "FuchiMMap", 0, &tm);
+  MMapType = RedisModule_CreateDataType(ctx, "FuchiMMap", MRDB_ENCVER, &tm);
   if (MMapType == NULL) return REDISMODULE_ERR;
+  if (RedisModule_RegisterInfoFunc(ctx, MInfo) == REDISMODULE_ERR) return REDISMODULE_ERR;
+  MMainThread = pthread_self();
+  RedisModule_SubscribeToServerEvent(ctx, RedisModuleEvent_ForkChild, MForkChildEvent);
+  RedisModule_SubscribeToServerEvent(ctx, RedisModuleEvent_CronLoop, MCronEvent);
+  RedisModule_SubscribeToServerEvent(ctx, RedisModuleEvent_Loading, MLoadingEvent);
 
-  // VMAP key file_path value_type [value_size] [writable]
+  // MMAP key file_path [value_type [value_size]] [writable|follow] [header] [embed]
   CREATE_CMD("MMAP", MMap_RedisCommand, "write fast", 1, 1);
 
-  // VCLEAR key
+  // VRELOAD key file_path [warm]
+  CREATE_CMD("VRELOAD", VReload_RedisCommand, "write", 1, 1);
+
+  // VCLEAR key [release]
   CREATE_CMD("VCLEAR", VClear_RedisCommand, "write fast", 1, 1);
 
-  // VADD key value [value ...]
+  // VADD key value [value ...] [sync]
   CREATE_CMD("VADD", VAdd_RedisCommand, "write fast", 1, 1);
 
   // VGET key index
@@ -1510,18 +4157,81 @@ int RedisModule_OnLoad(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
   // VMGET key index [index ...]
   CREATE_CMD("VMGET", VMGet_RedisCommand, "readonly fast", 1, 1);
 
+  // VMGETRAW key indices [uint32|uint64] [bitmap]
+  CREATE_CMD("VMGETRAW", VMGetRaw_RedisCommand, "readonly fast", 1, 1);
+
   // VALL key
   CREATE_CMD("VALL", VAll_RedisCommand, "readonly fast", 1, 1);
 
-  // VSET key index value [index value ...]
+  // VRANGE key start stop [step n]
+  CREATE_CMD("VRANGE", VRange_RedisCommand, "readonly fast", 1, 1);
+
+  // VSCAN key cursor [count n]
+  CREATE_CMD("VSCAN", VScan_RedisCommand, "readonly fast", 1, 1);
+
+  // VGETRAW key start count
+  CREATE_CMD("VGETRAW", VGetRaw_RedisCommand, "readonly fast", 1, 1);
+
+  // VSET key index value [index value ...] [sync]
   CREATE_CMD("VSET", VSet_RedisCommand, "write fast", 1, 1);
 
+  // VSETRAW key index values
+  CREATE_CMD("VSETRAW", VSetRaw_RedisCommand, "write fast", 1, 1);
+
+  // VMSETRAW key indices values
+  CREATE_CMD("VMSETRAW", VMSetRaw_RedisCommand, "write fast", 1, 1);
+
+  // VADDRAW key values [sync]
+  CREATE_CMD("VADDRAW", VAddRaw_RedisCommand, "write fast", 1, 1);
+
+  // VADDRAWAT key index values
+  CREATE_CMD("VADDRAWAT", VAddRawAt_RedisCommand, "write fast", 1, 1);
+
+  // VRESERVE key count
+  CREATE_CMD("VRESERVE", VReserve_RedisCommand, "write fast", 1, 1);
+
   // VCOUNT key
   CREATE_CMD("VCOUNT", VCount_RedisCommand, "readonly fast", 1, 1);
 
-  // VPOP key
+  // VSUM key [start stop]
+  CREATE_CMD("VSUM", VSum_RedisCommand, "readonly", 1, 1);
+
+  // VMIN key [start stop]
+  CREATE_CMD("VMIN", VMin_RedisCommand, "readonly", 1, 1);
+
+  // VMAX key [start stop]
+  CREATE_CMD("VMAX", VMax_RedisCommand, "readonly", 1, 1);
+
+  // VMEAN key [start stop]
+  CREATE_CMD("VMEAN", VMean_RedisCommand, "readonly", 1, 1);
+
+  // VSTDDEV key [start stop]
+  CREATE_CMD("VSTDDEV", VStddev_RedisCommand, "readonly", 1, 1);
+
+  // VJOBS
+  CREATE_CMD("VJOBS", VJobs_RedisCommand, "readonly fast", 0, 0);
+
+  // VJOBCANCEL id
+  CREATE_CMD("VJOBCANCEL", VJobCancel_RedisCommand, "readonly fast", 0, 0);
+
+  // VCONFIG GET pattern | VCONFIG SET name value
+  CREATE_CMD("VCONFIG", VConfig_RedisCommand, "admin fast", 0, 0);
+
+  // VPOP key [count]
   CREATE_CMD("VPOP", VPop_RedisCommand, "write fast", 1, 1);
 
+  // VTRUNCATE key count
+  CREATE_CMD("VTRUNCATE", VTruncate_RedisCommand, "write fast", 1, 1);
+
+  // VDIRTY key
+  CREATE_CMD("VDIRTY", VDirty_RedisCommand, "readonly", 1, 1);
+
+  // VDIRTYRESET key
+  CREATE_CMD("VDIRTYRESET", VDirtyReset_RedisCommand, "write", 1, 1);
+
+  // VSHRINK key
+  CREATE_CMD("VSHRINK", VShrink_RedisCommand, "write fast", 1, 1);
+
   // VFILEPATH key
   CREATE_CMD("VFILEPATH", VFilePath_RedisCommand, "readonly fast", 1, 1);
 
@@ -1531,5 +4241,15 @@ int RedisModule_OnLoad(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
   // VSIZE key
   CREATE_CMD("VSIZE", VSize_RedisCommand, "readonly fast", 1, 1);
 
+  // worker threads of the background jobs
+  for (long long i = 0; i < MThreads; ++i) {
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, MJobWorker, NULL) != 0) return REDISMODULE_ERR;
+    pthread_detach(thread);
+  }
+  pthread_t flusher;
+  if (pthread_create(&flusher, NULL, MFlushWorker, NULL) != 0) return REDISMODULE_ERR;
+  pthread_detach(flusher);
+
   return REDISMODULE_OK;
 }
@@ -7,6 +7,7 @@ import time
 import os
 import struct
 import time
+import math
 import numpy as np
 
 @pytest.fixture(scope="module", autouse=True)
@@ -219,6 +220,8 @@ def test_string(scope_module):
     assert r.execute_command('vfilepath db') == b'file.mmap'
     assert r.execute_command('vset db 1 ba 2 cba') == 2
     assert r.execute_command('vall db') == [b'a', b'ba', b'cba', b'abcd', b'abcd e']
+    assert r.execute_command('vset db 4 x') == 1
+    assert r.execute_command('vget db 4') == b'x'
     with pytest.raises(Exception):
       r.execute_command('vadd db 123456789')
     with pytest.raises(Exception):
@@ -266,3 +269,613 @@ def test_string(scope_module):
     for i in range(200):
       assert r.execute_command(f'vget db3 {i}') == f'{i}'.encode('utf8')
     assert r.execute_command('del db3') == 1
+
+def test_reserve(scope_module):
+    r = scope_module
+    r.execute_command('del db')
+    if os.path.exists('file.mmap'):
+      os.remove('file.mmap')
+    assert r.execute_command('mmap db file.mmap int32 writable') == 0
+    assert r.execute_command('vreserve db 1000') >= 1000
+    assert r.execute_command('vcount db') == 0
+    assert r.execute_command('vadd db 1 2 3') == 3
+    assert r.execute_command('vcount db') == 3
+    assert os.path.getsize('file.mmap') >= 4000
+    with pytest.raises(redis.exceptions.ResponseError):
+      r.execute_command('vreserve db 4611686018427387904')
+    assert r.execute_command('vreserve db 1000') >= 1000
+    with pytest.raises(Exception):
+      r.execute_command('vadd db 4 x')
+    assert r.execute_command('vall db') == [1, 2, 3]
+    assert r.execute_command('mmap db2 file.mmap int32') == 3
+    assert r.execute_command('del db2') == 1
+    assert r.execute_command('del db') == 1
+    assert os.path.getsize('file.mmap') == 12
+    assert not os.path.exists('file.mmap.len')
+
+def test_pop_shrink(scope_module):
+    r = scope_module
+    r.execute_command('del db')
+    if os.path.exists('file.mmap'):
+      os.remove('file.mmap')
+    assert r.execute_command('mmap db file.mmap int32 writable') == 0
+    assert r.execute_command('vadd db 1 2 3 4 5') == 5
+    assert r.execute_command('vpop db 2') == [5, 4]
+    assert r.execute_command('vpop db 10') == [3, 2, 1]
+    assert r.execute_command('vpop db') == None
+    assert r.execute_command('vpop db 2') == None
+    assert r.execute_command('vadd db 1 2 3') == 3
+    assert r.execute_command('vclear db') == 3
+    assert r.execute_command('vreserve db 0') > 0
+    assert r.execute_command('vclear db release') == 0
+    assert r.execute_command('vreserve db 0') == 0
+    assert r.execute_command('vadd db 1 2') == 2
+    assert r.execute_command('vshrink db') == 2
+    assert os.path.getsize('file.mmap') == 8
+    assert r.execute_command('vall db') == [1, 2]
+    assert r.execute_command('del db') == 1
+
+def test_range_scan(scope_module):
+    r = scope_module
+    r.execute_command('del db')
+    if os.path.exists('file.mmap'):
+      os.remove('file.mmap')
+    assert r.execute_command('mmap db file.mmap int16 writable') == 0
+    assert r.execute_command('vadd db 0 1 2 3 4 5 6 7 8 9') == 10
+    assert r.execute_command('vrange db 0 -1') == list(range(10))
+    assert r.execute_command('vrange db -3 -1') == [7, 8, 9]
+    assert r.execute_command('vrange db 2 100 step 3') == [2, 5, 8]
+    assert r.execute_command('vrange db 5 2') == []
+    with pytest.raises(Exception):
+      r.execute_command('vrange db 0 1 step 0')
+    values = []
+    cursor = 0
+    while True:
+      cursor, chunk = r.execute_command(f'vscan db {cursor} count 4')
+      assert len(chunk) <= 4
+      values += chunk
+      cursor = int(cursor)
+      if cursor == 0:
+        break
+    assert values == list(range(10))
+    assert r.execute_command('del db') == 1
+
+def test_getraw(scope_module):
+    r = scope_module
+    r.execute_command('del db')
+    if os.path.exists('file.mmap'):
+      os.remove('file.mmap')
+    assert r.execute_command('mmap db file.mmap double writable') == 0
+    assert r.execute_command('vadd db 0.5 -1.25 3 4') == 4
+    raw = r.execute_command('vgetraw db 1 2')
+    assert np.frombuffer(raw, dtype=np.float64).tolist() == [-1.25, 3]
+    assert len(r.execute_command('vgetraw db 2 100')) == 16
+    assert r.execute_command('vgetraw db 4 1') == b''
+    with pytest.raises(Exception):
+      r.execute_command('vgetraw db 5 1')
+    assert r.execute_command('del db') == 1
+
+def test_addraw(scope_module):
+    r = scope_module
+    r.execute_command('del db')
+    if os.path.exists('file.mmap'):
+      os.remove('file.mmap')
+    assert r.execute_command('mmap db file.mmap int32 writable') == 0
+    values = np.arange(-500, 500, dtype=np.int32)
+    assert r.execute_command('vaddraw', 'db', values.tobytes()) == 1000
+    assert r.execute_command('vaddraw', 'db', values[:3].tobytes()) == 3
+    with pytest.raises(Exception):
+      r.execute_command('vaddraw', 'db', b'\0\0\0')
+    assert r.execute_command('vcount db') == 1003
+    assert r.execute_command('vget db 0') == -500
+    assert r.execute_command('vrange db -3 -1') == [-500, -499, -498]
+    assert r.execute_command('del db') == 1
+    assert os.path.getsize('file.mmap') == 1003 * 4
+
+def test_setraw(scope_module):
+    r = scope_module
+    r.execute_command('del db')
+    if os.path.exists('file.mmap'):
+      os.remove('file.mmap')
+    assert r.execute_command('mmap db file.mmap float writable') == 0
+    assert r.execute_command('vaddraw', 'db', np.zeros(8, dtype=np.float32).tobytes()) == 8
+    assert r.execute_command('vsetraw', 'db', 2, np.array([1.5, 2.5], dtype=np.float32).tobytes()) == 2
+    with pytest.raises(Exception):
+      r.execute_command('vsetraw', 'db', 7, np.array([1.5, 2.5], dtype=np.float32).tobytes())
+    indices = np.array([7, 0], dtype=np.uint64).tobytes()
+    assert r.execute_command('vmsetraw', 'db', indices, np.array([-1, -2], dtype=np.float32).tobytes()) == 2
+    with pytest.raises(Exception):
+      r.execute_command('vmsetraw', 'db', np.array([8], dtype=np.uint64).tobytes(), np.zeros(1, dtype=np.float32).tobytes())
+    with pytest.raises(Exception):
+      r.execute_command('vmsetraw', 'db', indices, np.zeros(1, dtype=np.float32).tobytes())
+    raw = r.execute_command('vgetraw db 0 8')
+    assert np.frombuffer(raw, dtype=np.float32).tolist() == [-2, 0, 1.5, 2.5, 0, 0, 0, -1]
+    assert r.execute_command('del db') == 1
+
+def test_mgetraw(scope_module):
+    r = scope_module
+    r.execute_command('del db')
+    if os.path.exists('file.mmap'):
+      os.remove('file.mmap')
+    assert r.execute_command('mmap db file.mmap int16 writable') == 0
+    assert r.execute_command('vadd db 10 11 12 13') == 4
+    raw = r.execute_command('vmgetraw', 'db', np.array([3, 0], dtype=np.uint64).tobytes())
+    assert np.frombuffer(raw, dtype=np.int16).tolist() == [13, 10]
+    with pytest.raises(Exception):
+      r.execute_command('vmgetraw', 'db', np.array([3, 9], dtype=np.uint32).tobytes(), 'uint32')
+    with pytest.raises(Exception):
+      r.execute_command('vmgetraw', 'db', b'\x03\x00\x00', 'uint32')
+    raw, valid = r.execute_command('vmgetraw', 'db', np.array([3, 9, 1], dtype=np.uint32).tobytes(), 'uint32', 'bitmap')
+    assert np.frombuffer(raw, dtype=np.int16).tolist() == [13, 0, 11]
+    assert valid == b'\x05'
+    assert r.execute_command('del db') == 1
+
+def test_mget_batch(scope_module):
+    r = scope_module
+    r.execute_command('del db')
+    if os.path.exists('file.mmap'):
+      os.remove('file.mmap')
+    assert r.execute_command('mmap db file.mmap int32 writable') == 0
+    assert r.execute_command('vaddraw', 'db', (np.arange(5000, dtype=np.int32) * 3).tobytes()) == 5000
+    indices = np.random.randint(0, 5000, 200)
+    indices[10] = indices[20] = 4999
+    assert r.execute_command('vmget', 'db', *indices.tolist()) == (indices * 3).tolist()
+    raw = r.execute_command('vmgetraw', 'db', indices.astype(np.uint64).tobytes())
+    assert np.frombuffer(raw, dtype=np.int32).tolist() == (indices * 3).tolist()
+    assert r.execute_command('del db') == 1
+
+def test_aggregate(scope_module):
+    r = scope_module
+    r.execute_command('del db')
+    if os.path.exists('file.mmap'):
+      os.remove('file.mmap')
+    assert r.execute_command('mmap db file.mmap int16 writable') == 0
+    values = np.random.randint(-32768, 32767, 1000, dtype=np.int16)
+    assert r.execute_command('vaddraw', 'db', values.tobytes()) == 1000
+    assert r.execute_command('vsum db') == int(values.astype(np.int64).sum())
+    assert r.execute_command('vmin db') == int(values.min())
+    assert r.execute_command('vmax db') == int(values.max())
+    assert r.execute_command('vsum db 10 -10') == int(values[10:991].astype(np.int64).sum())
+    assert r.execute_command('vsum db 10 5') == 0
+    assert r.execute_command('vmin db 10 5') is None
+    assert abs(float(r.execute_command('vmean db')) - values.mean()) < 1e-9
+    assert abs(float(r.execute_command('vstddev db')) - values.std()) < 1e-6
+    assert r.execute_command('del db') == 1
+    os.remove('file.mmap')
+    assert r.execute_command('mmap db file.mmap float writable') == 0
+    values = np.random.randn(1001).astype(np.float32)
+    assert r.execute_command('vaddraw', 'db', values.tobytes()) == 1001
+    assert abs(float(r.execute_command('vsum db')) - values.astype(np.float64).sum()) < 1e-6
+    assert float(r.execute_command('vmin db')) == values.min()
+    assert float(r.execute_command('vmax db')) == values.max()
+    assert abs(float(r.execute_command('vstddev db')) - values.astype(np.float64).std()) < 1e-9
+    assert r.execute_command('del db') == 1
+    os.remove('file.mmap')
+    assert r.execute_command('mmap db file.mmap string 4 writable') == 0
+    with pytest.raises(Exception):
+      r.execute_command('vsum db')
+    assert r.execute_command('del db') == 1
+
+def test_jobs(scope_module):
+    r = scope_module
+    r.execute_command('del db')
+    if os.path.exists('file.mmap'):
+      os.remove('file.mmap')
+    threshold = r.execute_command('vconfig get job-threshold')[1]
+    assert r.execute_command('vconfig set job-threshold 1000') == b'OK'
+    with pytest.raises(Exception):
+      r.execute_command('vconfig set threads 1')
+    assert r.execute_command('mmap db file.mmap int32 writable') == 0
+    values = np.random.randint(-1000000, 1000000, 3000000, dtype=np.int32)
+    assert r.execute_command('vaddraw', 'db', values.tobytes()) == 3000000
+    assert r.execute_command('vsum db') == int(values.astype(np.int64).sum())
+    assert r.execute_command('vmin db 1 -2') == int(values[1:-1].min())
+    assert abs(float(r.execute_command('vstddev db')) - values.std()) < 1e-6
+    assert r.execute_command('vjobs') == []
+    assert r.execute_command('vjobcancel 12345') == 0
+    assert r.execute_command('vconfig set job-threshold', threshold) == b'OK'
+    assert r.execute_command('del db') == 1
+
+def test_pagein(scope_module):
+    r = scope_module
+    r.execute_command('del db')
+    if os.path.exists('file.mmap'):
+      os.remove('file.mmap')
+    values = np.arange(4000000, dtype=np.int32)
+    values.tofile('file.mmap')
+    fd = os.open('file.mmap', os.O_RDONLY)
+    os.fsync(fd)
+    os.posix_fadvise(fd, 0, 0, os.POSIX_FADV_DONTNEED)
+    os.close(fd)
+    assert r.execute_command('vconfig get pagein') == [b'pagein', 1]
+    pageins = r.info('FuchiMMap')['FuchiMMap_pageins']
+    assert r.execute_command('mmap db file.mmap int32') == 4000000
+    assert r.execute_command('vget db 3000000') == 3000000
+    # the cold page was read on a worker thread before the reply
+    info = r.info('FuchiMMap')
+    assert info['FuchiMMap_pageins'] == pageins + 1
+    assert info['FuchiMMap_pagein_bytes'] > 0
+    assert r.execute_command('vmget db 5 1000000 3999999 5') == [5, 1000000, 3999999, 5]
+    assert r.execute_command('vrange db 2000000 2000002') == [2000000, 2000001, 2000002]
+    assert np.frombuffer(r.execute_command('vgetraw db 3500000 3'), dtype=np.int32).tolist() == [3500000, 3500001, 3500002]
+    assert r.info('FuchiMMap')['FuchiMMap_pageins'] > pageins + 1
+    assert r.execute_command('del db') == 1
+
+def test_gather_jobs(scope_module):
+    r = scope_module
+    r.execute_command('del db')
+    if os.path.exists('file.mmap'):
+      os.remove('file.mmap')
+    threshold = r.execute_command('vconfig get gather-threshold')[1]
+    assert r.execute_command('vconfig set gather-threshold 1000') == b'OK'
+    assert r.execute_command('mmap db file.mmap int32 writable') == 0
+    values = np.random.randint(-1000000, 1000000, 100000, dtype=np.int32)
+    assert r.execute_command('vaddraw', 'db', values.tobytes()) == 100000
+    indices = np.random.randint(0, 100000, 20000)
+    assert r.execute_command('vmget', 'db', *indices.tolist()) == values[indices].tolist()
+    assert r.execute_command('vrange db 10 -10 step 3') == values[10:-9:3].tolist()
+    assert r.execute_command('vconfig set gather-threshold', threshold) == b'OK'
+    assert r.execute_command('del db') == 1
+
+def test_jobs_with_writes(scope_module):
+    r = scope_module
+    r.execute_command('del db')
+    if os.path.exists('file.mmap'):
+      os.remove('file.mmap')
+    threshold = r.execute_command('vconfig get job-threshold')[1]
+    assert r.execute_command('vconfig set job-threshold 1000') == b'OK'
+    assert r.execute_command('mmap db file.mmap int32 writable') == 0
+    values = np.arange(10000000, dtype=np.int32)
+    assert r.execute_command('vaddraw', 'db', values.tobytes()) == 10000000
+    assert r.execute_command('vshrink db') == 10000000
+    # the appends remap the key while the sum reads the old mapping
+    r2 = redis.Redis()
+    pipe = r2.pipeline(transaction=False)
+    pipe.execute_command('vsum db')
+    pipe.execute_command('vcount db')
+    import threading
+    result = []
+    t = threading.Thread(target=lambda: result.extend(pipe.execute()))
+    t.start()
+    for i in range(100):
+      r.execute_command('vaddraw', 'db', np.arange(10000, dtype=np.int32).tobytes())
+    t.join()
+    assert result[0] >= int(values.astype(np.int64).sum())
+    assert r.execute_command('vcount db') == 11000000
+    assert r.execute_command('vconfig set job-threshold', threshold) == b'OK'
+    assert r.execute_command('del db') == 1
+
+def test_shared_file(scope_module):
+    r = scope_module
+    r.execute_command('del db db2 db3')
+    if os.path.exists('file.mmap'):
+      os.remove('file.mmap')
+    assert r.execute_command('mmap db file.mmap int32 writable') == 0
+    assert r.execute_command('vadd db 1 2 3') == 3
+    assert r.execute_command('mmap db2 file.mmap int32') == 3
+    assert r.execute_command('vadd db 4') == 1
+    assert r.execute_command('vall db2') == [1, 2, 3, 4]
+    assert r.execute_command('mmap db3 file.mmap int32 writable') == 4
+    assert r.execute_command('del db') == 1
+    assert r.execute_command('vadd db3 5') == 1
+    assert r.execute_command('vall db2') == [1, 2, 3, 4, 5]
+    assert r.execute_command('del db3') == 1
+    assert r.execute_command('vcount db2') == 5
+    assert r.execute_command('del db2') == 1
+    assert os.path.getsize('file.mmap') == 20
+    assert not os.path.exists('file.mmap.len')
+
+def test_follow(scope_module):
+    r = scope_module
+    r.execute_command('del db')
+    if os.path.exists('file.mmap'):
+      os.remove('file.mmap')
+    interval = r.execute_command('vconfig get follow-interval')[1]
+    assert r.execute_command('vconfig set follow-interval 10') == b'OK'
+    np.arange(3, dtype=np.int32).tofile('file.mmap')
+    with pytest.raises(redis.exceptions.ResponseError):
+      r.execute_command('mmap db file.mmap int32 writable follow')
+    assert r.execute_command('mmap db file.mmap int32 follow') == 3
+    with open('file.mmap', 'ab') as f:
+      f.write(np.arange(100000, dtype=np.int32).tobytes())
+    time.sleep(0.1)
+    assert r.execute_command('vcount db') == 100003
+    assert r.execute_command('vget db 100002') == 99999
+    assert r.execute_command('vconfig set follow-interval', interval) == b'OK'
+    assert r.execute_command('del db') == 1
+
+def test_reload(scope_module):
+    r = scope_module
+    r.execute_command('del db')
+    np.arange(5, dtype=np.int32).tofile('file.mmap')
+    np.arange(100000, dtype=np.int32).tofile('file2.mmap')
+    with pytest.raises(redis.exceptions.ResponseError):
+      r.execute_command('vreload db file2.mmap')
+    assert r.execute_command('mmap db file.mmap int32') == 5
+    with pytest.raises(redis.exceptions.ResponseError):
+      r.execute_command('vreload db nofile.mmap')
+    assert r.execute_command('vcount db') == 5
+    assert r.execute_command('vreload db file2.mmap') == 100000
+    assert r.execute_command('vget db 99999') == 99999
+    assert r.execute_command('vreload db file.mmap warm') == 5
+    assert r.execute_command('vfilepath db') == b'file.mmap'
+    assert r.execute_command('del db') == 1
+    os.remove('file2.mmap')
+
+def test_fsync(scope_module):
+    r = scope_module
+    r.execute_command('del db')
+    if os.path.exists('file.mmap'):
+      os.remove('file.mmap')
+    assert r.execute_command('vconfig get fsync') == [b'fsync', b'everysec']
+    with pytest.raises(redis.exceptions.ResponseError):
+      r.execute_command('vconfig set fsync sometimes')
+    assert r.execute_command('mmap db file.mmap int32 writable') == 0
+    assert r.execute_command('vadd db 1 2 3') == 3
+    time.sleep(1.5)
+    info = r.info('FuchiMMap')
+    assert info['FuchiMMap_lag'] == 0
+    assert info['FuchiMMap_last_flush'] > 0
+    assert r.execute_command('vconfig set fsync always') == b'OK'
+    assert r.execute_command('vset db 1 5') == 1
+    assert r.info('FuchiMMap')['FuchiMMap_policy'] == 'always'
+    assert r.execute_command('vconfig set fsync everysec') == b'OK'
+    assert r.execute_command('del db') == 1
+
+def test_sync(scope_module):
+    r = scope_module
+    r.execute_command('del db')
+    if os.path.exists('file.mmap'):
+      os.remove('file.mmap')
+    assert r.execute_command('mmap db file.mmap int32 writable') == 0
+    assert r.execute_command('vadd db 1 2 3 sync') == 3
+    assert r.execute_command('vset db 0 9 sync') == 1
+    assert r.execute_command('vset db 1 8 2 7 sync') == 2
+    assert r.execute_command('vaddraw', 'db', np.array([4], dtype=np.int32).tobytes(), 'sync') == 1
+    with pytest.raises(redis.exceptions.ResponseError):
+      r.execute_command('vaddraw', 'db', np.array([4], dtype=np.int32).tobytes(), 'nosync')
+    assert r.execute_command('vall db') == [9, 8, 7, 4]
+    pipe = r.pipeline(transaction=True)
+    pipe.execute_command('vadd db 5 sync')
+    assert pipe.execute() == [1]
+    assert r.execute_command('del db') == 1
+    # a string key stores "sync" as a value
+    os.remove('file.mmap')
+    assert r.execute_command('mmap db file.mmap string 4 writable') == 0
+    assert r.execute_command('vadd db abc sync') == 2
+    assert r.execute_command('vall db') == [b'abc', b'sync']
+    assert r.execute_command('del db') == 1
+
+def test_header(scope_module):
+    r = scope_module
+    r.execute_command('del db db2')
+    if os.path.exists('file.mmap'):
+      os.remove('file.mmap')
+    assert r.execute_command('mmap db file.mmap int32 writable header') == 0
+    assert r.execute_command('vadd db 1 2 3') == 3
+    assert r.execute_command('mmap db2 file.mmap') == 3
+    assert r.execute_command('vtype db2') == b'int32'
+    assert r.execute_command('del db2') == 1
+    with pytest.raises(redis.exceptions.ResponseError):
+      r.execute_command('mmap db2 file.mmap float')
+    assert r.execute_command('del db') == 1
+    assert os.path.getsize('file.mmap') == 65536 + 12
+    # values past the committed count are dropped
+    with open('file.mmap', 'ab') as f:
+      f.write(b'\x01\x02')
+    assert r.execute_command('mmap db file.mmap') == 3
+    assert r.execute_command('vall db') == [1, 2, 3]
+    assert r.execute_command('del db') == 1
+    np.arange(3, dtype=np.int32).tofile('file.mmap')
+    with pytest.raises(redis.exceptions.ResponseError):
+      r.execute_command('mmap db file.mmap')
+    with pytest.raises(redis.exceptions.ResponseError):
+      r.execute_command('mmap db file.mmap int32 writable header')
+    # a read-only key can't write a header to an empty file
+    open('file.mmap', 'wb').close()
+    with pytest.raises(redis.exceptions.ResponseError):
+      r.execute_command('mmap db file.mmap int32 header')
+
+def test_embed(scope_module):
+    r = scope_module
+    r.execute_command('del db')
+    for path in ['file.mmap', 'file.mmap.copy']:
+      if os.path.exists(path):
+        os.remove(path)
+    assert r.execute_command('mmap db file.mmap int32 writable header embed') == 0
+    assert r.execute_command('vadd db 1 2 3') == 3
+    assert r.execute_command('vconfig set embed-path {path}.copy') == b'OK'
+    r.execute_command('debug reload')
+    assert r.execute_command('vfilepath db') == b'file.mmap.copy'
+    assert r.execute_command('vall db') == [1, 2, 3]
+    assert r.execute_command('vconfig set embed-path {path}') == b'OK'
+    # a file which has the embedded values already is left as it is
+    inode = os.stat('file.mmap.copy').st_ino
+    r.execute_command('debug reload')
+    assert os.stat('file.mmap.copy').st_ino == inode
+    assert r.execute_command('vall db') == [1, 2, 3]
+    assert r.execute_command('del db') == 1
+    os.remove('file.mmap.copy')
+
+def test_truncate(scope_module):
+    r = scope_module
+    r.execute_command('del db')
+    if os.path.exists('file.mmap'):
+      os.remove('file.mmap')
+    assert r.execute_command('mmap db file.mmap int32 writable') == 0
+    assert r.execute_command('vadd db 1 2 3 4') == 4
+    assert r.execute_command('vtruncate db 2') == 2
+    assert r.execute_command('vall db') == [1, 2]
+    with pytest.raises(redis.exceptions.ResponseError):
+      r.execute_command('vtruncate db 3')
+    assert r.execute_command('vtruncate db 0') == 2
+    assert r.execute_command('vcount db') == 0
+    assert r.execute_command('del db') == 1
+
+def test_dirty(scope_module):
+    r = scope_module
+    r.execute_command('del db')
+    np.arange(100000, dtype=np.int32).tofile('file.mmap')
+    assert r.execute_command('mmap db file.mmap int32 writable') == 100000
+    assert r.execute_command('vdirty db') == []
+    assert r.execute_command('vset db 0 5 50000 7') == 2
+    assert r.execute_command('vdirtyreset db') == [[0, 16384], [49152, 16384]]
+    assert r.execute_command('vdirty db') == []
+    assert r.execute_command('vadd db 1') == 1
+    assert r.execute_command('vdirty db') == [[98304, 1697]]
+    with pytest.raises(redis.exceptions.ResponseError):
+      r.execute_command('vdirty db reset')
+    # the dropped values are reported past the logical end
+    assert r.execute_command('vdirtyreset db') == [[98304, 1697]]
+    assert r.execute_command('vtruncate db 90000') == 10001
+    assert r.execute_command('vdirty db') == [[81920, 18081]]
+    # only the reset moves the epoch of the key
+    assert b'readonly' in r.execute_command('command info vdirty')[0][2]
+    assert b'write' in r.execute_command('command info vdirtyreset')[0][2]
+    assert r.execute_command('del db') == 1
+
+def wait_aof_rewrite(r):
+    time.sleep(0.1)
+    while True:
+      info = r.info('persistence')
+      if info['aof_rewrite_in_progress'] == 0 and info['aof_rewrite_scheduled'] == 0:
+        break
+      time.sleep(0.1)
+
+def test_aof_rewrite(scope_module):
+    r = scope_module
+    r.execute_command('del db db2')
+    if os.path.exists('file.mmap'):
+      os.remove('file.mmap')
+    np.arange(3, dtype=np.int32).tofile('file2.mmap')
+    assert r.execute_command('mmap db file.mmap int32 writable') == 0
+    assert r.execute_command('vadd db 1 2 3') == 3
+    assert r.execute_command('mmap db2 file2.mmap int32') == 3
+    r.config_set('aof-use-rdb-preamble', 'no')
+    r.config_set('appendonly', 'yes')
+    wait_aof_rewrite(r)
+    r.execute_command('bgrewriteaof')
+    wait_aof_rewrite(r)
+    r.execute_command('debug loadaof')
+    assert r.execute_command('vall db') == [1, 2, 3]
+    assert r.execute_command('vall db2') == [0, 1, 2]
+    r.config_set('appendonly', 'no')
+    r.config_set('aof-use-rdb-preamble', 'yes')
+    assert r.execute_command('del db db2') == 2
+    os.remove('file2.mmap')
+
+def test_replicate_aof(scope_module):
+    r = scope_module
+    r.execute_command('del db')
+    if os.path.exists('file.mmap'):
+      os.remove('file.mmap')
+    assert r.execute_command('mmap db file.mmap int32 writable') == 0
+    assert r.execute_command('vadd db 1 2 3') == 3
+    r.config_set('appendonly', 'yes')
+    wait_aof_rewrite(r)
+    # replayed on top of the file which already has the writes
+    assert r.execute_command('vadd db 4 5') == 2
+    assert r.execute_command('vset db 0 9 4 8') == 2
+    assert r.execute_command('vpop db') == 8
+    assert r.execute_command('vadd db 6') == 1
+    r.execute_command('debug loadaof')
+    assert r.execute_command('vcount db') == 5
+    assert r.execute_command('vall db') == [9, 2, 3, 4, 6]
+    r.config_set('appendonly', 'no')
+    assert r.execute_command('del db') == 1
+
+def test_replica(scope_module):
+    r = scope_module
+    r.execute_command('del db')
+    if os.path.exists('file.mmap'):
+      os.remove('file.mmap')
+    replica_dir = os.path.abspath('replica')
+    os.makedirs(replica_dir, exist_ok=True)
+    if os.path.exists(os.path.join(replica_dir, 'file.mmap')):
+      os.remove(os.path.join(replica_dir, 'file.mmap'))
+    with open(os.path.join(replica_dir, 'redis.conf'), 'w') as f:
+      f.write(f'port 6380\ndir {replica_dir}\nloadmodule {os.path.abspath("fmmap.so")}\n'
+              'replicaof 127.0.0.1 6379\n')
+    replica = subprocess.Popen(["redis-server", os.path.join(replica_dir, 'redis.conf')],
+                               stdout=open(os.path.join(replica_dir, 'log.txt'), mode='w'))
+    r2 = redis.Redis(port=6380)
+    try:
+      for _ in range(50):
+        time.sleep(0.1)
+        try:
+          if r2.info('replication')['master_link_status'] == 'up':
+            break
+        except redis.exceptions.ConnectionError:
+          pass
+      assert r.execute_command('mmap db file.mmap int32 writable') == 0
+      assert r.execute_command('vadd db 1 2 3') == 3
+      assert r.execute_command('vset db 1 7') == 1
+      assert r.execute_command('vpop db') == 3
+      assert r.execute_command('wait', 1, 1000) == 1
+      assert r2.execute_command('vall db') == [1, 7]
+      assert r.execute_command('del db') == 1
+    finally:
+      replica.terminate()
+      replica.wait()
+
+def test_reload_header(scope_module):
+    r = scope_module
+    r.execute_command('del db db2')
+    for path in ['file.mmap', 'file2.mmap']:
+      if os.path.exists(path):
+        os.remove(path)
+    assert r.execute_command('mmap db file.mmap int32 writable header') == 0
+    assert r.execute_command('vadd db 1 2 3') == 3
+    open('file2.mmap', 'wb').close()
+    # the new file gets a header as well
+    assert r.execute_command('vreload db file2.mmap warm') == 0
+    assert r.execute_command('vadd db 4 5') == 2
+    assert r.execute_command('mmap db2 file2.mmap') == 2
+    assert r.execute_command('vtype db2') == b'int32'
+    assert r.execute_command('del db db2') == 2
+    os.remove('file2.mmap')
+
+def test_aggregate_compensated(scope_module):
+    r = scope_module
+    r.execute_command('del db')
+    for value_type, dtype in [('double', np.float64), ('float', np.float32)]:
+      if os.path.exists('file.mmap'):
+        os.remove('file.mmap')
+      # each small value is below half an ulp of the large one
+      values = np.concatenate([[1e16 if dtype == np.float64 else 1e9], np.full(100003, 0.5, dtype=dtype)]).astype(dtype)
+      values.tofile('file.mmap')
+      assert r.execute_command(f'mmap db file.mmap {value_type}') == 100004
+      expected = math.fsum(values.astype(np.float64))
+      assert abs(float(r.execute_command('vsum db')) - expected) <= 2
+      assert abs(float(r.execute_command('vsum db 1 -1')) - math.fsum(values[1:].astype(np.float64))) <= 1e-9
+      assert r.execute_command('del db') == 1
+
+def test_flushall_async(scope_module):
+    r = scope_module
+    r.execute_command('del db')
+    if os.path.exists('file.mmap'):
+      os.remove('file.mmap')
+    assert r.execute_command('mmap db file.mmap int32 writable') == 0
+    assert r.execute_command('vreserve db 1000') == 1000
+    assert r.execute_command('vadd db 1 2 3') == 3
+    # the keys freed on the lazyfree thread are closed on the main thread
+    r.execute_command('flushall async')
+    time.sleep(0.5)
+    assert os.path.getsize('file.mmap') == 12
+    assert not os.path.exists('file.mmap.len')
+
+def test_embed_key(scope_module):
+    r = scope_module
+    r.execute_command('del ../db')
+    if os.path.exists('file.mmap'):
+      os.remove('file.mmap')
+    assert r.execute_command('mmap ../db file.mmap int32 writable embed') == 0
+    assert r.execute_command('vadd ../db 1 2') == 2
+    # the key can't lead the file out of the directory
+    assert r.execute_command('vconfig set embed-path embed-{key}') == b'OK'
+    r.execute_command('debug reload')
+    assert r.execute_command('vconfig set embed-path {path}') == b'OK'
+    assert r.execute_command('vfilepath ../db') == b'embed-%2E.%2Fdb'
+    assert r.execute_command('vall ../db') == [1, 2]
+    assert r.execute_command('del ../db') == 1
+    os.remove('embed-%2E.%2Fdb')